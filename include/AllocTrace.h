@@ -0,0 +1,120 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include "Common.h"
+#include <pthread.h>
+
+// 申请/释放事件追踪
+// 编译时定义ALLOC_TRACE开启；未定义时TRACE_ENABLED为false，钩子是被丢弃的if constexpr分支，申请路径上没有任何额外代码
+// 开启后每个线程把事件写入自己的环形缓冲区（单生产者单消费者，无锁），缓冲区满时丢弃事件并计数，不阻塞申请路径
+// 后台线程每毫秒把所有缓冲区中的事件拷贝到追踪文件的映射窗口中：文件头之后是连续的TraceEvent，
+// 同一线程的事件按发生顺序排列，不同线程的事件交错成段，需要全局顺序时按_time排序
+// （释放事件在释放前记录、申请事件在申请后记录，同一地址被释放又被其它线程申请时，按时间排序不会颠倒）
+// 线程退出后缓冲区交给之后创建的线程继续使用，同一编号的事件在时间上不会重叠
+// fork出的子进程中没有后台线程，不再记录；回放见tests/TraceReplay.cpp
+
+#ifdef ALLOC_TRACE
+constexpr bool TRACE_ENABLED = true;
+#else
+constexpr bool TRACE_ENABLED = false;
+#endif
+
+enum TraceOp : uint8_t
+{
+    TRACE_ALLOC = 0,
+    TRACE_FREE = 1,
+};
+
+/// @brief 一条申请或释放事件
+struct TraceEvent
+{
+    uint64_t _time;   // 距开始追踪的纳秒数
+    uint64_t _ptr;    // 块的地址
+    uint32_t _size;   // 申请大小，不带大小的释放为0，超过4GB的按UINT32_MAX记录
+    uint16_t _thread; // 线程编号（即环形缓冲区的编号）
+    uint8_t _op;      // TraceOp
+    uint8_t _pad;
+};
+
+/// @brief 追踪文件头，与一条事件等长，文件按事件大小整齐分块
+struct TraceFileHeader
+{
+    char _magic[8];      // "CMPTRACE"
+    uint32_t _version;   // 格式版本
+    uint32_t _eventSize; // sizeof(TraceEvent)
+    uint64_t _count;     // 事件数，停止追踪时写入
+};
+static_assert(sizeof(TraceFileHeader) == sizeof(TraceEvent), "header occupies one event slot");
+
+class AllocTrace
+{
+public:
+    static const uint32_t VERSION = 2;
+    static const size_t STOP_FAILED = (size_t)-1; // Stop没能写出完整的追踪文件
+
+    /// @brief 申请/释放路径上的钩子，未开启追踪时编译为空
+    static void Record(TraceOp op, void *obj, size_t size)
+    {
+        if constexpr (TRACE_ENABLED)
+        {
+            if (_active.load(std::memory_order_acquire)) // 与Start中设置的起始时刻同步
+                Append(op, obj, size);
+        }
+    }
+
+    /// @brief 写入文件头并启动后台线程，之后的事件写入fd
+    /// @details fd必须是可以ftruncate和mmap的普通文件（或memfd），文件按窗口逐段扩展和映射
+    /// @return 编译时未开启追踪或已经在追踪时返回false
+    static bool Start(int fd);
+
+    /// @brief 停止记录，写出缓冲区中剩余的事件后结束后台线程，不关闭fd
+    /// @return 因缓冲区满而丢弃的事件数；文件扩展、截断或写入文件头中的事件数失败时返回STOP_FAILED
+    static size_t Stop();
+
+private:
+    static const size_t RING_SIZE = 1 << 16;                      // 每个缓冲区的事件数，2的幂
+    static const size_t WINDOW_SIZE = sizeof(TraceEvent) * 4096 * 64; // 映射窗口的大小，既是页的整数倍又是事件的整数倍
+
+    /// @brief 一个线程的环形缓冲区，生产者只推进_tail，后台线程只推进_head
+    struct Ring
+    {
+        alignas(64) std::atomic<size_t> _head{0}; // 下一条待写出的事件
+        alignas(64) std::atomic<size_t> _tail{0}; // 下一条事件写入的位置
+        std::atomic<size_t> _dropped{0};          // 缓冲区满时丢弃的事件数
+        std::atomic<bool> _owned{true};           // 是否有线程正在使用
+        uint16_t _thread = 0;
+        Ring *_next = nullptr;
+        TraceEvent _events[RING_SIZE];
+    };
+
+    static void Append(TraceOp op, void *obj, size_t size); // 写入当前线程的缓冲区
+    static Ring *AcquireRing();                            // 为当前线程取得一个缓冲区
+    static void ThreadExit(void *arg);                     // 线程退出时交还缓冲区
+    static void DrainRing(Ring *ring);                      // 把一个缓冲区中的事件写入文件
+    static void Emit(const TraceEvent *events, size_t n);    // 把n条事件拷贝到映射窗口中
+    static bool NextWindow();                               // 扩展文件并映射下一个窗口
+    static void AtForkChild();                              // 子进程中没有后台线程，停止记录
+    static void DrainLoop();                                // 后台线程
+    static uint64_t Now();
+
+private:
+    static __thread Ring *_tRing;   // 当前线程的缓冲区
+    static __thread bool _tDrainer; // 后台线程自身的申请不记录
+
+    static std::atomic<bool> _active;
+    static std::atomic<bool> _stop;
+    static std::atomic<Ring *> _rings; // 所有缓冲区组成的单链表，只增不减
+    static std::atomic<uint16_t> _ringNum;
+    static std::mutex _mtx; // 保护Start/Stop
+    static int _fd;
+    static char *_window;      // 当前映射的窗口
+    static size_t _windowOff;  // 窗口在文件中的偏移
+    static size_t _windowUsed; // 窗口中已写入的字节数
+    static uint64_t _count;    // 已写入的事件数
+    static uint64_t _epoch; // 开始追踪的时刻
+    static pthread_t _drainer;
+    static pthread_key_t _key;
+    static pthread_once_t _keyOnce;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef ALLOCATOR_STATS_H
+#define ALLOCATOR_STATS_H
+
+#include "Common.h"
+#include <cstdarg>
+#include <cstdio>
+#include <unistd.h>
+
+// 内存池运行时统计
+// 快速路径上不增加任何计数：tc的缓存量直接读自由链表长度，锁的计数在持有锁时更新，
+// 与系统之间的往来只在mmap/munmap/madvise时累加，所有代价都由收集的一方承担
+
+/// @brief 一把锁的获取次数和其中需要等待的次数
+struct LockStats
+{
+    size_t _acquires = 0;  // 获取成功的次数
+    size_t _contended = 0; // 其中需要等待的次数
+};
+
+/// @brief 一个尺寸类（桶）的统计
+struct SizeClassStats
+{
+    size_t _size = 0;            // 该桶的块大小
+    size_t _tcObjects = 0;       // 所有tc中缓存的块数
+    size_t _tcBytes = 0;         // 所有tc中缓存的字节数
+    size_t _transferObjects = 0; // cc中转缓存中的块数
+    size_t _spans = 0;           // cc中该桶的Span数
+    size_t _inUseObjects = 0;    // 已从这些Span分出去的块数，包括tc和中转缓存中的
+    size_t _freeObjects = 0;     // 还留在这些Span中的块数
+    LockStats _lock;             // 桶锁
+};
+
+/// @brief 一个PageCache分片的统计
+struct ArenaStats
+{
+    size_t _freeSpans[PAGE_NUM + 1] = {}; // 下标为页数，值为该页数的空闲Span数
+    size_t _freePages = 0;                // 空闲页总数
+    size_t _returnedPages = 0;            // 其中已通过madvise还给系统的页数
+    LockStats _lock;                      // 分片锁
+};
+
+/// @brief 整个内存池的统计快照
+/// @details 各部分分别加锁收集，彼此之间不是同一时刻的精确值
+struct AllocatorStats
+{
+    size_t _threadCaches = 0;               // 参与统计的tc数（每CPU缓存模式下为槽数）
+    SizeClassStats _classes[FREE_LIST_NUM]; // 按桶下标
+    ArenaStats _arenas[ARENA_NUM];          // 按分片下标
+    size_t _mappedBytes = 0;                // 累计向系统映射的字节数
+    size_t _unmappedBytes = 0;              // 累计解除映射的字节数
+    size_t _releasedBytes = 0;              // 累计通过madvise归还物理页的字节数
+};
+
+/// @brief 输出到文件描述符，攒满一个栈上缓冲区再write，不申请堆内存
+/// @details 统计和堆采样的导出共用
+struct FdOut
+{
+    explicit FdOut(int fd) : _fd(fd) {} // _buf只在_used之前有内容，不需要清零
+
+    int _fd;
+    char _buf[4096];
+    size_t _used = 0;
+
+    void Printf(const char *fmt, ...)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(_buf + _used, sizeof(_buf) - _used, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+
+        if (_used + n >= sizeof(_buf))
+        { // 放不下就先把之前的写出去再重新格式化，单行不会超过缓冲区
+            Flush();
+            va_start(ap, fmt);
+            n = vsnprintf(_buf, sizeof(_buf), fmt, ap);
+            va_end(ap);
+            if (n < 0)
+                return;
+        }
+        _used += n;
+    }
+
+    void Flush()
+    {
+        size_t off = 0;
+        while (off < _used)
+        {
+            ssize_t w = write(_fd, _buf + off, _used - off);
+            if (w <= 0)
+                break;
+            off += w;
+        }
+        _used = 0;
+    }
+};
+
+/// @brief 收集一份统计快照
+/// @details 依次获取tc全局链表锁、cc各桶锁和pc各分片锁，不会同时持有两把
+AllocatorStats GetAllocatorStats();
+
+/// @brief 将统计快照格式化到buf中，json为true时输出JSON，否则输出对齐的文本表格
+/// @return 完整输出需要的字节数（不含结尾的'\0'），大于等于len时表示被截断
+size_t FormatAllocatorStats(const AllocatorStats &stats, char *buf, size_t len, bool json = false);
+
+/// @brief 收集统计并直接写到文件描述符fd中
+/// @details 不申请堆内存，可以在收到信号后调用；但收集时要获取内存池的锁，
+///          建议由专门的线程通过sigwait等待信号后调用，而不是在异步信号处理函数中直接调用
+void DumpAllocatorStats(int fd, bool json = false);
+
+#endif
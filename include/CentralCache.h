@@ -1,17 +1,225 @@
 #ifndef CENTRAL_CACHE_H
 #define CENTRAL_CACHE_H
 #include "Common.h"
+#include "AllocatorStats.h"
+#include "PageCache.h"
 
+/// @brief 一个尺寸类的中转缓存，存放tc之间整批流转的、已经串好的块链表
+/// @details tc归还的一批块先放在这里，另一个tc补充时整批取走，不需要逐块拆回Span
+class TransferCache
+{
+public:
+    /// @brief 放入一批块，缓存已满时返回false，由调用者还回Span
+    bool Insert(void *start, void *end, size_t n, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_count >= Capacity(size))
+            return false;
+
+        _batches[_count++] = {start, end, n};
+        return true;
+    }
+
+    /// @brief 取出最近放入的一批块，没有时返回0
+    size_t Remove(void *&start, void *&end)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_count == 0)
+            return 0;
+
+        Batch &batch = _batches[--_count];
+        start = batch._start;
+        end = batch._end;
+        return batch._n;
+    }
+
+    // fork前后由ForkLock/ForkUnlock整体加锁和解锁
+    void lock()
+    {
+        _mtx.lock();
+    }
+
+    void unlock()
+    {
+        _mtx.unlock();
+    }
+
+    /// @brief 当前缓存的总块数，供统计使用
+    size_t Objects()
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        size_t n = 0;
+        for (size_t i = 0; i < _count; ++i)
+            n += _batches[i]._n;
+        return n;
+    }
+
+private:
+    /// @brief 按单批字节数限制批次数，避免大块尺寸类在这里囤积太多空间
+    static size_t Capacity(size_t size)
+    {
+        size_t batchBytes = SizeClass::NumMoveSize(size) * size;
+        size_t cap = TRANSFER_BYTES / batchBytes;
+        if (cap > TRANSFER_SLOTS)
+            cap = TRANSFER_SLOTS;
+        else if (cap < 1)
+            cap = 1;
+        return cap;
+    }
+
+private:
+    struct Batch
+    {
+        void *_start; // 第一块
+        void *_end;   // 最后一块，LoadNext(_end)为nullptr
+        size_t _n;    // 块数
+    };
+
+    std::mutex _mtx;                     // 只保护本尺寸类的中转缓存，与桶锁互不影响
+    Batch _batches[TRANSFER_SLOTS] = {}; // 按栈的方式使用，最近放入的块更可能还在CPU缓存中
+    size_t _count = 0;                   // 当前批次数
+};
+
+/// @brief 一个尺寸类在cc中的所有Span，按占用率分组
+/// @details 有空闲块的Span按已分配块数占容量的比例放进OCCUPANCY_BINS组，没有空闲块的单独一组；
+///          补充时直接取占用率最高的非空组中的Span：新分出的块集中在快满的Span上，
+///          占用率低的Span得以陆续全部还回、交还pc，而不是每个Span都零散地留着几块
+///          各组是不带哨兵的环形双链表，只存头指针，非空组记在位图中，取Span和移动Span都是O(1)
+class SpanBins
+{
+public:
+    static const size_t FULL = OCCUPANCY_BINS; // 没有空闲块的Span所在的组
+
+    /// @brief 占用率最高的有空闲块的Span，没有时返回nullptr
+    Span *Pick() const
+    {
+        if (_mask == 0)
+            return nullptr;
+        return _heads[31 - __builtin_clz(_mask)];
+    }
+
+    /// @brief 按span当前的占用率放入对应的组
+    void Insert(Span *span)
+    {
+        span->_bin = BinOf(span);
+        Link(span);
+    }
+
+    /// @brief span的已分配块数变化后调用，跨组时移到新组的头部
+    void Update(Span *span)
+    {
+        size_t bin = BinOf(span);
+        if (bin == span->_bin)
+            return;
+        Unlink(span);
+        span->_bin = bin;
+        Link(span);
+    }
+
+    void Erase(Span *span)
+    {
+        Unlink(span);
+    }
+
+    /// @brief 依次对每个Span调用f，需持有_mtx
+    template <class F>
+    void ForEach(F &&f) const
+    {
+        for (size_t bin = 0; bin <= FULL; ++bin)
+        {
+            Span *head = _heads[bin];
+            if (head == nullptr)
+                continue;
+            Span *span = head;
+            do
+            {
+                f(span);
+                span = span->next;
+            } while (span != head);
+        }
+    }
+
+private:
+    static size_t BinOf(const Span *span)
+    {
+        if (span->_use_count >= span->_capacity)
+            return FULL;
+        return span->_use_count * OCCUPANCY_BINS / span->_capacity;
+    }
+
+    /// @brief 插到span->_bin组的头部，最近进入该组的Span最先被取用
+    void Link(Span *span)
+    {
+        Span *&head = _heads[span->_bin];
+        if (head == nullptr)
+        {
+            span->prev = span->next = span;
+            if (span->_bin != FULL)
+                _mask |= 1u << span->_bin;
+        }
+        else
+        {
+            span->next = head;
+            span->prev = head->prev;
+            head->prev->next = span;
+            head->prev = span;
+        }
+        head = span;
+    }
+
+    void Unlink(Span *span)
+    {
+        Span *&head = _heads[span->_bin];
+        if (span->next == span)
+        {
+            head = nullptr;
+            if (span->_bin != FULL)
+                _mask &= ~(1u << span->_bin);
+        }
+        else
+        {
+            span->prev->next = span->next;
+            span->next->prev = span->prev;
+            if (head == span)
+                head = span->next;
+        }
+        span->prev = span->next = nullptr;
+    }
+
+    static_assert(OCCUPANCY_BINS <= 32, "bins are tracked in a 32-bit mask");
+
+private:
+    Span *_heads[OCCUPANCY_BINS + 1] = {}; // 各组的头，最后一组是FULL
+    uint32_t _mask = 0;                    // 第i位表示第i组非空，不含FULL组
+
+public:
+    CountingMutex _mtx; // 桶锁，同时统计获取和竞争次数
+};
+
+// 每个NUMA节点一个CentralCache，节点内的线程从本节点的实例补充，Span从本节点的PageCache分片切出
+// Span始终挂在切出它的节点的实例中，其它节点的线程释放的块也要还到这里
 class CentralCache
 {
 public:
-    // 单例接口
+    // 当前线程所在节点的实例，节点由线程绑定的PageCache分片决定
     static CentralCache *GetInstance()
     {
-        return &_sInst;
+        return &_sInst[PageCache::GetInstance()->Node()];
+    }
+
+    // 管理span的实例
+    static CentralCache *GetInstance(Span *span)
+    {
+        return &_sInst[span->_arena % Numa::NodeCount()];
     }
 
-    /// @brief CentralCache从自己的_spanLists中为ThreadCache提供所需要的块空间
+    // 第i个节点的实例
+    static CentralCache *GetNode(size_t i)
+    {
+        return &_sInst[i];
+    }
+
+    /// @brief CentralCache从自己的_spanBins中为ThreadCache提供所需要的块空间
     /// @param start 提供的空间的第一块起始地址（输出型参数）
     /// @param end 提供的空间的最后一块起始地址（输出型参数）
     /// @param n 块数
@@ -19,23 +227,41 @@ public:
     /// @return 分配的总块数
     size_t FetchRangeObj(void *&start, void *&end, size_t n, size_t size);
 
-    // 获取一个管理空间不为空的Span
-    Span *GetOneSpan(SpanList &list, size_t size);
+    // 获取一个还有空闲块的Span，优先占用率最高的，没有时向pc申请新的Span
+    Span *GetOneSpan(SpanBins &bins, size_t size);
 
-    /// @brief 将tc还回来的多块空间放到Span中
+    /// @brief 将tc还回来的多块空间放到Span中，块可能来自其它节点，逐块还给管理其Span的实例
     /// @param size 单块空间大小
     void ReleaseListToSpans(void*start,size_t size);
 
+    /// @brief tc归还一批块，优先整批放入第一块所属节点的中转缓存，放不下时再拆回Span
+    /// @param start 第一块起始地址
+    /// @param end 最后一块起始地址
+    /// @param n 块数
+    /// @param size 单块空间大小
+    void ReleaseRangeObj(void *start, void *end, size_t n, size_t size);
+
+    // 将所有中转缓存中的块拆回Span，以便空闲Span能还给pc
+    void FlushTransferCaches();
+
+    // 逐桶加锁，把各桶的Span、块和锁的使用情况累加到stats中
+    void CollectStats(AllocatorStats &stats);
+
+    // fork前按桶下标依次持有所有桶锁和中转缓存锁，fork后在父子进程中释放
+    void ForkLock();
+    void ForkUnlock();
+
 private:
     // 隐藏构造、拷贝构造、赋值构造函数
-    CentralCache() {};
+    constexpr CentralCache() {};
 
     CentralCache(CentralCache &copy) = delete;
     CentralCache &operator=(CentralCache &copy) = delete;
 
 private:
-    SpanList _spanLists[FREE_LIST_NUM]; // 每个哈希桶中挂的是一个个Span
-    static CentralCache _sInst;         // 饿汉模式创建一个CentralCache
+    SpanBins _spanBins[FREE_LIST_NUM];            // 每个哈希桶中按占用率分组挂着一个个Span
+    TransferCache _transferCaches[FREE_LIST_NUM]; // 每个哈希桶前面的中转缓存
+    static CentralCache _sInst[NUMA_NODE_NUM]; // 饿汉模式创建各节点的CentralCache
 };
 
 #endif
\ No newline at end of file
@@ -6,16 +6,46 @@
 #include <assert.h>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <sys/mman.h>
+#ifdef HARDENED_FREELIST
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <sys/random.h>
+#endif
 using std::cout;
 using std::endl;
 using std::vector;
 
+// 全局单例必须在编译期完成初始化：替换malloc后，申请可能早于任何动态初始化发生
+// 构造函数都是constexpr的，这里让编译器在做不到时直接报错
+#if defined(__clang__)
+#define CONSTINIT [[clang::require_constant_initialization]]
+#elif defined(__GNUC__) && __GNUC__ >= 10
+#define CONSTINIT __constinit
+#else
+#define CONSTINIT
+#endif
+
 typedef size_t PageID;
 
-static const size_t FREE_LIST_NUM = 208;    // 哈希表中自由链表的个数
-static const size_t MAX_BYTES = 256 * 1024; // ThreadCache单次申请的最大字节数
-static const size_t PAGE_NUM = 128;         // span的最大管理页数
-static const size_t PAGE_SHIFT = 12;        // 一页4KB，12位
+static const size_t MAX_BYTES = 256 * 1024;      // ThreadCache单次申请的最大字节数
+static const size_t PAGE_NUM = 128;              // span的最大管理页数
+static const size_t SPAN_MAX_PAGES = 8;          // cc切分用Span的页数上限，Span中还有一块在用就整个留在cc中，越小越不容易被零星的长寿命块占住
+static const size_t SPAN_MIN_OBJECTS = 8;        // 块较大时Span至少放下的块数，优先于SPAN_MAX_PAGES
+static const size_t PAGE_SHIFT = 12;             // 一页4KB，12位
+static const size_t SCAVENGE_PAGES = 1024;       // 每向pc归还这么多页，触发一次空闲页回收
+static const size_t TC_SCAVENGE_FREES = 4096;    // tc每回收这么多块，按低水位线收缩一次自由链表
+static const size_t TRANSFER_SLOTS = 64;         // 每个中转缓存最多存放的批次数
+static const size_t TRANSFER_BYTES = 128 * 1024; // 每个中转缓存最多存放的字节数
+static const size_t ARENA_NUM = 8;               // PageCache分片数，线程在所在节点的分片中按到达顺序轮流绑定
+static const size_t NUMA_NODE_NUM = 4;           // 最多区分的NUMA节点数，CentralCache每个节点一份
+static const size_t HUGE_PAGE_PAGES = (2 << 20) >> PAGE_SHIFT; // 一个2MB透明大页包含的页数
+static const size_t OCCUPANCY_BINS = 8;          // cc中按占用率给有空闲块的Span划分的组数
+static const size_t CPU_CACHE_CLASS_BYTES = 32 * 1024; // 每CPU缓存的rseq路径中每个桶最多缓存的字节数
+static const size_t SIZE_CLASS_STEPS = 8;        // 每个2的幂区间划分的尺寸类数，128字节以上的内部碎片不超过1/8
 
 /// @brief obj的一个指针大小的字节
 /// @details 用static修饰，防止多个.cpp文件重复包含该Common头文件导致链接时产生冲突
@@ -25,15 +55,162 @@ static void *&ObjNext(void *obj)
     return *(void **)obj;
 }
 
+#ifdef HARDENED_FREELIST
+CONSTINIT inline std::atomic<uintptr_t> freeListSecret{0}; // 进程内随机的掩码，第一次写入链接时生成
+
+/// @brief 取得自由链表链接的掩码，第一次调用时从getrandom生成
+static uintptr_t FreeListSecret()
+{
+    uintptr_t secret = freeListSecret.load(std::memory_order_relaxed);
+    if (__builtin_expect(secret == 0, 0))
+    {
+        uintptr_t fresh = 0;
+        if (getrandom(&fresh, sizeof(fresh), GRND_NONBLOCK) != (ssize_t)sizeof(fresh))
+        { // 熵池还没准备好时退化为栈地址和时间
+            timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            fresh = ((uintptr_t)&fresh * 0x9E3779B97F4A7C15ull) ^ (uintptr_t)ts.tv_nsec;
+        }
+        fresh |= 1; // 0表示尚未生成
+        // 多个线程同时生成时只保留一个，失败的一方读到胜出的值
+        secret = freeListSecret.compare_exchange_strong(secret, fresh) ? fresh : secret;
+    }
+    return secret;
+}
+
+/// @brief 链接被改写后解码出的地址不在合法范围内，直接终止进程
+[[noreturn]] static void FreeListCorrupted(const void *obj)
+{
+    fprintf(stderr, "ConcurrentMemoryPool: corrupted free list near %p\n", obj);
+    abort();
+}
+
+/// @brief 解引用自由链表中的块之前检查：必须是某个正在使用的小块Span中一块的起始地址，否则终止进程
+/// @details tc中的块来自多个Span，只能通过页号映射确认，定义在PageCache.cpp中
+void CheckFreeLink(void *obj);
+#endif
+
+/// @brief 读取空闲块obj中存放的下一块地址
+/// @details 开启HARDENED_FREELIST时链接按safe-linking的方式存放：next ^ (obj所在页号) ^ 进程掩码，
+///          溢出写入空闲块的数据解码后几乎不可能恰好落在合法的块上，弹出时即可发现
+static void *LoadNext(void *obj)
+{
+#ifdef HARDENED_FREELIST
+    return (void *)(*(uintptr_t *)obj ^ ((uintptr_t)obj >> PAGE_SHIFT) ^ FreeListSecret());
+#else
+    return ObjNext(obj);
+#endif
+}
+
+/// @brief 在空闲块obj中存放下一块地址next
+static void StoreNext(void *obj, void *next)
+{
+#ifdef HARDENED_FREELIST
+    *(uintptr_t *)obj = (uintptr_t)next ^ ((uintptr_t)obj >> PAGE_SHIFT) ^ FreeListSecret();
+#else
+    ObjNext(obj) = next;
+#endif
+}
+
+/// @brief 与系统之间的内存往来，只在mmap/munmap/madvise前后更新，不在快速路径上
+struct SystemCounters
+{
+    std::atomic<size_t> _mappedBytes{0};   // 累计向系统映射的字节数
+    std::atomic<size_t> _unmappedBytes{0}; // 累计解除映射的字节数
+    std::atomic<size_t> _releasedBytes{0}; // 累计通过madvise归还物理页的字节数
+};
+
+CONSTINIT inline SystemCounters systemCounters; // 所有编译单元共用一份
+
 /// @brief 向系统申请k页内存空间
-void *SystemAlloc(size_t k)
+/// @details 直接mmap，起始地址天然按页对齐，页号左移PAGE_SHIFT后就是真实地址
+static void *SystemAlloc(size_t k)
 {
-    void *ptr = malloc(k << PAGE_SHIFT);
-    if (ptr == nullptr)
+    void *ptr = mmap(nullptr, k << PAGE_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
         throw std::bad_alloc();
+    systemCounters._mappedBytes.fetch_add(k << PAGE_SHIFT, std::memory_order_relaxed);
     return ptr;
 }
 
+/// @brief 向系统申请k页内存空间，起始地址按align页对齐
+/// @details 多映射align-1页，再把首尾多出的部分解除映射
+static void *SystemAllocAligned(size_t k, size_t align)
+{
+    size_t bytes = k << PAGE_SHIFT;
+    size_t alignBytes = align << PAGE_SHIFT;
+    char *ptr = (char *)SystemAlloc(k + align - 1);
+
+    char *aligned = (char *)(((uintptr_t)ptr + alignBytes - 1) & ~(uintptr_t)(alignBytes - 1));
+    if (aligned > ptr)
+        munmap(ptr, aligned - ptr);
+    size_t tail = (ptr + ((k + align - 1) << PAGE_SHIFT)) - (aligned + bytes);
+    if (tail > 0)
+        munmap(aligned + bytes, tail);
+    systemCounters._unmappedBytes.fetch_add((aligned - ptr) + tail, std::memory_order_relaxed);
+
+    return aligned;
+}
+
+/// @brief 解除SystemAlloc申请的k页空间的映射，可以只是某次申请的一部分
+static void SystemFree(void *ptr, size_t k)
+{
+    munmap(ptr, k << PAGE_SHIFT);
+    systemCounters._unmappedBytes.fetch_add(k << PAGE_SHIFT, std::memory_order_relaxed);
+}
+
+/// @brief 保留k页的地址空间，只把物理页还给系统，再次访问时由内核重新清零映射
+static void SystemRelease(void *ptr, size_t k)
+{
+    madvise(ptr, k << PAGE_SHIFT, MADV_DONTNEED);
+    systemCounters._releasedBytes.fetch_add(k << PAGE_SHIFT, std::memory_order_relaxed);
+}
+
+/// @brief 记录获取次数和竞争次数的互斥锁，接口与std::mutex相同
+/// @details 计数器只在持有锁时修改，由锁本身保护，不需要额外的原子操作
+class CountingMutex
+{
+public:
+    void lock()
+    {
+        if (!_mtx.try_lock())
+        { // 已被其它线程持有，记为一次竞争后再阻塞等待
+            _mtx.lock();
+            ++_contended;
+        }
+        ++_acquires;
+    }
+
+    bool try_lock()
+    {
+        if (!_mtx.try_lock())
+            return false;
+        ++_acquires;
+        return true;
+    }
+
+    void unlock()
+    {
+        _mtx.unlock();
+    }
+
+    // 以下两个读取需要持有锁，否则只是近似值
+    size_t Acquires() const
+    {
+        return _acquires;
+    }
+
+    size_t Contended() const
+    {
+        return _contended;
+    }
+
+private:
+    std::mutex _mtx;
+    size_t _acquires = 0;  // 获取成功的次数
+    size_t _contended = 0; // 其中需要等待的次数
+};
+
 class FreeList
 {
 public:
@@ -42,20 +219,20 @@ public:
     {
         // 头插
         assert(obj); // 插入非空空间
-        ObjNext(obj) = _freeList;
+        StoreNext(obj, _freeList);
 
-        ++_size;
+        SetSize(size() + 1);
 
         _freeList = obj;
     }
 
     // 插入多块空间
-    void pushRange(void *start, void *end, size_t size)
+    void pushRange(void *start, void *end, size_t n)
     {
-        ObjNext(end) = _freeList;
+        StoreNext(end, _freeList);
         _freeList = start;
 
-        _size += size;
+        SetSize(size() + n);
     }
 
     // 提供空间
@@ -64,26 +241,60 @@ public:
         // 头删
         assert(_freeList); // 提供空间的前提是要有空间
         void *obj = _freeList;
-        _freeList = ObjNext(obj);
+#ifdef HARDENED_FREELIST
+        CheckFreeLink(obj); // 链接可能被溢出改写过，先确认再解引用
+#endif
+        _freeList = LoadNext(obj);
 
-        --_size;
+        SetSize(size() - 1);
 
         return obj;
     }
 
     void PopRange(void *&start, void *&end, size_t n)
     {
-        assert(n <= _size);
+        assert(n <= size());
 
         start = end = _freeList;
-        for (int i = 0; i < n - 1; ++i)
+        for (size_t i = 0; i < n - 1; ++i)
         {
-            end = ObjNext(end);
+#ifdef HARDENED_FREELIST
+            CheckFreeLink(end);
+#endif
+            end = LoadNext(end);
         }
 
-        _freeList = ObjNext(end);
-        ObjNext(end) = nullptr;
-        _size -= n;
+#ifdef HARDENED_FREELIST
+        CheckFreeLink(end);
+#endif
+        _freeList = LoadNext(end);
+        StoreNext(end, nullptr);
+        SetSize(size() - n);
+    }
+
+    // 弹出n块依次写入objs，n不能超过size()
+    void PopBatch(void **objs, size_t n)
+    {
+        assert(n <= size());
+
+        void *cur = _freeList;
+        for (size_t i = 0; i < n; ++i)
+        {
+#ifdef HARDENED_FREELIST
+            CheckFreeLink(cur);
+#endif
+            objs[i] = cur;
+            cur = LoadNext(cur);
+        }
+
+        _freeList = cur;
+        SetSize(size() - n);
+    }
+
+    // 查看第一块空间，不弹出
+    void *front()
+    {
+        return _freeList;
     }
 
     // 判断是否为空
@@ -98,122 +309,239 @@ public:
         return _maxSize;
     }
 
-    size_t size()
+    // 统计线程会并发读取，因此是原子变量；只有所属线程写，读写都用relaxed，不需要加锁的读-改-写指令
+    size_t size() const
     {
-        return _size;
+        return _size.load(std::memory_order_relaxed);
+    }
+
+    // 上次重置以来自由链表的最小块数，这些块在整个周期内都没有被用到
+    size_t LowWater()
+    {
+        return _lowWater;
+    }
+
+    // 开始新的统计周期
+    void ResetLowWater()
+    {
+        _lowWater = size();
+    }
+
+private:
+    // 更新块数，减少时同时更新低水位线
+    void SetSize(size_t n)
+    {
+        _size.store(n, std::memory_order_relaxed);
+        if (n < _lowWater)
+            _lowWater = n;
     }
 
 private:
-    void *_freeList = nullptr; // 自由链表，初始为空
-    size_t _maxSize = 1;       // 当前自由链表申请未达到上限时，能够申请的最大空间块数
-    size_t _size = 0;          // 当前自由链表的块数量
+    void *_freeList = nullptr;    // 自由链表，初始为空
+    size_t _maxSize = 1;          // 当前自由链表申请未达到上限时，能够申请的最大空间块数
+    std::atomic<size_t> _size{0}; // 当前自由链表的块数量
+    size_t _lowWater = 0;         // 当前统计周期内的最小块数（低水位线）
 };
 
-/// @brief 计算线程申请的空间大小对齐后的字节数
-class SizeClass
+/// @brief 尺寸类的生成规则，在编译期展开成SizeClassTable
+/// @details 第一类8字节，之后都是16字节的倍数，满足alignof(max_align_t)；
+///          [2^k, 2^(k+1))区间内的步长为max(16, 2^k/SIZE_CLASS_STEPS)，
+///          超过128字节的申请向上取整到所在尺寸类时浪费不超过1/SIZE_CLASS_STEPS
+constexpr size_t NextClassSize(size_t size)
 {
-public:
-    /// @brief 计算size对齐后的大小
-    static size_t RoundUp(size_t size)
-    {
-        assert(size <= MAX_BYTES);
+    size_t pow = 1;
+    while (pow * 2 <= size)
+        pow *= 2;
 
-        size_t alignNum = 0;
-        if (size <= 128)
-            alignNum = 8;
-        else if (size <= 1024)
-            alignNum = 16;
-        else if (size <= 8 * 1024)
-            alignNum = 128;
-        else if (size <= 64 * 1024)
-            alignNum = 1024;
-        else if (size <= 256 * 1024)
-            alignNum = 8 * 1024;
+    size_t step = pow / SIZE_CLASS_STEPS;
+    return size + (step < 16 ? (size < 16 ? 8 : 16) : step);
+}
 
-        return _RoundUp(size, alignNum);
-    }
+/// @brief 尺寸类的个数
+constexpr size_t CountClasses()
+{
+    size_t n = 0;
+    for (size_t size = 8; size <= MAX_BYTES; size = NextClassSize(size))
+        ++n;
+    return n;
+}
 
-    /// @brief 计算size对应到的桶下标
-    static inline size_t Index(size_t size)
-    {
-        assert(size <= MAX_BYTES);
+static constexpr size_t FREE_LIST_NUM = CountClasses(); // 哈希表中自由链表的个数
+
+/// @brief 编译期生成的尺寸类表
+/// @details 申请大小先换算成查找下标：不超过1KB时按8字节一档，之后按128字节一档，
+///          再经_index一次查表得到桶下标；块大小、单批块数和单次申请页数按桶下标存放
+struct SizeClassTable
+{
+    static constexpr size_t SMALL_MAX = 1024;
+    static constexpr size_t LOOKUP_NUM = ((MAX_BYTES + 127 + (120 << 7)) >> 7) + 1;
 
-        size_t res = -1;
-        static int group_array[4] = {16, 52, 52, 52}; // 前4个区间的各区间链表数
-        if (size <= 128)
-            res = _Index(size, 3);
-        else if (size <= 1024)
-            res = _Index(size - 128, 4) + group_array[0];
-        else if (size <= 8 * 1024)
-            res = _Index(size - 1024, 7) + group_array[1] + group_array[0];
-        else if (size <= 64 * 1024)
-            res = _Index(size - 8 * 1024, 10) + group_array[2] + group_array[1] + group_array[0];
-        else if (size <= 256 * 1024)
-            res = _Index(size - 64 * 1024, 13) + group_array[3] + group_array[2] + group_array[1] + group_array[0];
+    uint8_t _index[LOOKUP_NUM] = {};     // 查找下标 -> 桶下标
+    uint32_t _size[FREE_LIST_NUM] = {};  // 桶下标 -> 块大小
+    uint16_t _batch[FREE_LIST_NUM] = {}; // 桶下标 -> tc与cc之间单批移动的最大块数
+    uint8_t _pages[FREE_LIST_NUM] = {};  // 桶下标 -> cc向pc单次申请的页数
 
-        return res;
+    /// @brief 申请大小对应的查找下标，与tcmalloc的ClassIndex相同
+    static constexpr size_t LookupIndex(size_t size)
+    {
+        return size <= SMALL_MAX ? (size + 7) >> 3 : (size + 127 + (120 << 7)) >> 7;
     }
 
-    /// @brief 计算块空间大小为size时，单次能够申请的最大块数
-    static size_t NumMoveSize(size_t size)
+    constexpr SizeClassTable()
     {
-        assert(size > 0);
+        size_t index = 0;
+        for (size_t size = 8; size <= MAX_BYTES; size = NextClassSize(size), ++index)
+        {
+            _size[index] = (uint32_t)size;
+            _batch[index] = (uint16_t)BatchOf(size);
+            _pages[index] = (uint8_t)PagesOf(size, BatchOf(size));
+        }
 
-        // 计算块数
-        int num = MAX_BYTES / size;
+        // 每个查找下标取能容纳该档最大申请的最小尺寸类
+        index = 0;
+        for (size_t i = 0; i < LOOKUP_NUM; ++i)
+        {
+            size_t maxSize = i <= (SMALL_MAX >> 3) ? i << 3 : (i - 120) << 7;
+            while (_size[index] < maxSize)
+                ++index;
+            _index[i] = (uint8_t)index;
+        }
+    }
 
-        // 保证单次分配的块数控制在[2,512]
+    /// @brief 单批块数：按256KB估算，控制在[2,512]
+    static constexpr size_t BatchOf(size_t size)
+    {
+        size_t num = MAX_BYTES / size;
         if (num > 512)
             num = 512;
         else if (num < 2)
             num = 2;
-
         return num;
     }
 
-    /// @brief 块页匹配算法
-    static size_t NumMovePage(size_t size)
+    /// @brief 单次申请的页数：放下一批块，但不超过SPAN_MAX_PAGES页（块较大时放下SPAN_MIN_OBJECTS块），
+    ///        再逐页增加直到Span尾部切不出整块的浪费不超过1/SIZE_CLASS_STEPS
+    /// @details Span放不下整批时，cc这一次只交出这个Span中剩余的块；Span越小，零星的长寿命块占住的空闲块越少
+    static constexpr size_t PagesOf(size_t size, size_t batch)
     {
-        size_t num = NumMoveSize(size); // 最大分配块数
-        size_t npage = num * size;      // 单次申请的最大空间
-        npage >> PAGE_SHIFT;            // 页数
-        return npage == 0 ? 1 : npage;  // 至少分配一页，不足一页时也分配一页
+        size_t bytes = batch * size;
+        size_t limit = SPAN_MAX_PAGES << PAGE_SHIFT;
+        if (limit < SPAN_MIN_OBJECTS * size)
+            limit = SPAN_MIN_OBJECTS * size;
+        if (bytes > limit)
+            bytes = limit;
+
+        size_t npage = bytes >> PAGE_SHIFT;
+        if (npage == 0)
+            npage = 1;
+        while (npage < PAGE_NUM && (((npage << PAGE_SHIFT) < size) ||
+                                    ((npage << PAGE_SHIFT) % size) * SIZE_CLASS_STEPS > (npage << PAGE_SHIFT)))
+            ++npage;
+        return npage;
     }
+};
 
-private:
-    static inline size_t _Index(size_t size, size_t align_shift)
+inline constexpr SizeClassTable sizeClassTable{};
+
+static_assert(FREE_LIST_NUM <= 256, "桶下标需要放进uint8_t");
+static_assert(SizeClassTable::LookupIndex(MAX_BYTES) < SizeClassTable::LOOKUP_NUM, "查找表覆盖不到MAX_BYTES");
+
+/// @brief 计算线程申请的空间大小对齐后的字节数
+class SizeClass
+{
+public:
+    /// @brief 计算size对应到的桶下标，一次查表
+    static inline size_t Index(size_t size)
+    {
+        assert(size <= MAX_BYTES);
+        return sizeClassTable._index[SizeClassTable::LookupIndex(size)];
+    }
+
+    /// @brief 计算size对齐后的大小，超过256KB时按页对齐
+    static inline size_t RoundUp(size_t size)
     {
-        return ((size + (1 << align_shift) - 1) >> align_shift) - 1;
+        if (size > MAX_BYTES)
+            return _RoundUp(size, 1 << PAGE_SHIFT);
+        return sizeClassTable._size[Index(size)];
     }
 
+    /// @brief 下标为index的桶对应的块大小
+    static inline size_t ClassSize(size_t index)
+    {
+        assert(index < FREE_LIST_NUM);
+        return sizeClassTable._size[index];
+    }
+
+    /// @brief 计算块空间大小为size时，单次能够申请的最大块数
+    static inline size_t NumMoveSize(size_t size)
+    {
+        assert(size > 0);
+        return sizeClassTable._batch[Index(size)];
+    }
+
+    /// @brief 块页匹配算法，cc为size所在的桶向pc单次申请的页数
+    static inline size_t NumMovePage(size_t size)
+    {
+        return sizeClassTable._pages[Index(size)];
+    }
+
+private:
     static size_t _RoundUp(size_t size, size_t alignNum)
     {
         return ((size + alignNum - 1) & ~(alignNum - 1));
     }
 };
 
+#ifdef HUGEPAGE_SPANS
+/// @brief 一个2MB对齐的大页区域，PageCache以它为单位向系统申请和归还
+struct HugePage
+{
+    PageID _base = 0;          // 首页页号
+    size_t _usedPages = 0;     // 已分配出去的页数
+    size_t _freeEpoch = 0;     // 变为完全空闲时的回收周期编号
+    HugePage *_prev = nullptr; // 所属分片的大页链表
+    HugePage *_next = nullptr;
+};
+#endif
+
 /// @brief 以页为基本单位的结构体
 struct Span
 {
     PageID _pageID = 0;        // 页号
-    size_t _n;                 // 管理的页数量
-    void *_freeList = nullptr; // 管理的小块空间的头节点
+    size_t _n = 0;             // 管理的页数量
+    void *_freeList = nullptr; // 还回来的小块空间的头节点
+    char *_carve = nullptr;    // 下一块从未分出过的空间，cc按需从这里往后切分
+    char *_carveEnd = nullptr; // 最后一整块的末尾，_carve到达这里时Span已全部切完
     size_t _use_count = 0;     // 已分配的小块空间数量
+    size_t _capacity = 0;      // 切分出的小块总数
+    size_t _bin = 0;           // 在cc中所在的占用率分组
     Span *prev = nullptr;      // 前一个Span节点
     Span *next = nullptr;      // 后一个Span节点
     bool _isUse = false;       // 是否在pc中
+    size_t _objSize = 0;       // 切分出的小块空间大小，释放时不需要再传size
+    bool _isReturned = false;  // 空闲页是否已通过madvise还给系统
+    size_t _freeEpoch = 0;     // 挂入pc时的回收周期编号
+    size_t _arena = 0;         // 所属的PageCache分片
+    bool _isLarge = false;     // 是否整个直接分配给了用户（大块或超过一页的对齐申请），释放时直接还给pc
+    void *_sample = nullptr;   // 被堆分析采样时指向采样记录
+#ifdef HUGEPAGE_SPANS
+    HugePage *_huge = nullptr; // 所在的大页，超过128页或按更大粒度对齐的Span为空
+#endif
+#ifdef GUARDED_ALLOC
+    std::atomic<uint64_t> *_allocBits = nullptr; // 调试模式下每块一位的分配状态
+#endif
 };
 
 class SpanList
 {
 public:
-    SpanList()
+    // constexpr保证全局的SpanList在编译期完成初始化，早于任何动态初始化中的malloc调用
+    constexpr SpanList()
+        : _head(&_sentinel) // 哨兵直接内嵌，构造时不需要向系统申请内存
     {
-        _head = new Span;
-
         // 由于是双向链表，所以需要正确初始化prev、next
-        _head->prev = _head;
-        _head->next = _head;
+        _sentinel.prev = &_sentinel;
+        _sentinel.next = &_sentinel;
     }
 
     /// @brief 弹出第一个Span
@@ -270,9 +598,10 @@ public:
     }
 
 private:
-    Span *_head; // 哨兵头节点
+    Span _sentinel; // 哨兵头节点本体
+    Span *_head;    // 哨兵头节点
 public:
-    std::mutex _mtx; // 每个CentralCache中的桶都要有一个桶锁（多线程安全）
+    CountingMutex _mtx; // 每个CentralCache中的桶都要有一个桶锁（多线程安全），同时统计获取和竞争次数
 };
 
 #endif
\ No newline at end of file
@@ -2,26 +2,335 @@
 #define CONCURRENT_ALLOC_H
 
 #include "ThreadCache.h"
+#include "PageCache.h"
+#include "AllocatorStats.h"
+#include "HeapProfiler.h"
+#include "GuardedAlloc.h"
+#include "AllocTrace.h"
+#ifdef PER_CPU_CACHE
+#include "CpuCache.h"
+#endif
 
 /// @brief 线程申请空间的函数
 void *ConcurrentAlloc(size_t size)
 {
-    cout << std::this_thread::get_id() << " " << pTLSThreadCache << endl;
+    if (HeapProfiler::ShouldSample(size))
+    { // 采样倒计时用完，慢路径中重新抽取，需要采样时由分析器单独分配
+        void *obj = HeapProfiler::SampleAlloc(size);
+        if (obj)
+        {
+            AllocTrace::Record(TRACE_ALLOC, obj, size);
+            return obj;
+        }
+    }
+
+    if (size > MAX_BYTES)
+    { // 大块空间跳过tc和cc，直接向pc申请，超过128页时pc会直接向系统申请
+        size_t alignSize = SizeClass::RoundUp(size);
+        size_t kpage = alignSize >> PAGE_SHIFT;
+
+        PageCache *pc = PageCache::GetInstance();
+        pc->_pageMtx.lock();
+        Span *span = pc->NewSpan(kpage);
+        span->_isUse = true;        // 防止被相邻Span合并
+        span->_isLarge = true;      // 释放时据此判断走大块路径
+        span->_objSize = alignSize;
+        pc->_pageMtx.unlock();
 
+        void *obj = (void *)(span->_pageID << PAGE_SHIFT);
+        AllocTrace::Record(TRACE_ALLOC, obj, size);
+        return obj;
+    }
+
+#ifdef PER_CPU_CACHE
+    void *obj = CpuCache::GetInstance()->Allocate(size);
+#else
     // 由于每个线程都有一个独立的全局对象，因此不存在线程安全问题
     if (pTLSThreadCache == nullptr)
     {
-        pTLSThreadCache = new ThreadCache;
+        ThreadCache::Create();
+    }
+
+    void *obj = pTLSThreadCache->Allocate(size);
+#endif
+
+#ifdef GUARDED_ALLOC
+    AllocGuard::OnAlloc(obj);
+#endif
+    AllocTrace::Record(TRACE_ALLOC, obj, size);
+    return obj;
+}
+
+/// @brief 一次申请n块size大小的空间，依次写入objs[0]到objs[n-1]
+/// @details 同一尺寸类的块先从tc的自由链表中整段取出，不够的部分直接向cc整批申请，
+///          整批只查一次TLS和尺寸类；释放时可以用ConcurrentFreeBatch，也可以逐个ConcurrentFree
+void ConcurrentAllocBatch(size_t size, void **objs, size_t n)
+{
+    if (size > MAX_BYTES)
+    { // 大块没有可以整批取的缓存
+        for (size_t i = 0; i < n; ++i)
+            objs[i] = ConcurrentAlloc(size);
+        return;
+    }
+    if (n == 0)
+        return;
+
+    if (HeapProfiler::ShouldSample(size * n))
+    { // 整批按总字节数扣减，最多采样其中一块
+        void *obj = HeapProfiler::SampleAlloc(size);
+        if (obj)
+        {
+            AllocTrace::Record(TRACE_ALLOC, obj, size);
+            *objs++ = obj;
+            if (--n == 0)
+                return;
+        }
+    }
+
+#ifdef PER_CPU_CACHE
+    CpuCache::GetInstance()->AllocateBatch(size, objs, n);
+#else
+    if (pTLSThreadCache == nullptr)
+    {
+        ThreadCache::Create();
+    }
+
+    pTLSThreadCache->AllocateBatch(size, objs, n);
+#endif
+
+#ifdef GUARDED_ALLOC
+    for (size_t i = 0; i < n; ++i)
+        AllocGuard::OnAlloc(objs[i]);
+#endif
+    if constexpr (TRACE_ENABLED)
+    {
+        for (size_t i = 0; i < n; ++i)
+            AllocTrace::Record(TRACE_ALLOC, objs[i], size);
+    }
+}
+
+/// @brief 申请起始地址按align字节对齐的空间，align为2的幂
+/// @details 不超过一页的对齐：把大小向上取整到align的倍数，对应尺寸类也是align的倍数，
+///          而Span按页对齐，所以切出的每一块都天然对齐，和普通申请共用tc/cc
+///          超过一页的对齐：直接从pc切出起始页对齐的Span
+///          两种情况都不会多申请再调整指针，释放时使用ConcurrentFree(obj)；
+///          使用ConcurrentFree(obj, size)时size必须是向上取整到align倍数后的大小，
+///          原始大小可能落在更小的尺寸类，超过一页的对齐得到的整Span也只有页整数倍的size才会被识别
+void *ConcurrentAllocAligned(size_t size, size_t align)
+{
+    assert(align > 0 && (align & (align - 1)) == 0);
+
+    if (size == 0)
+        size = 1;
+    size_t alignSize = (size + align - 1) & ~(align - 1);
+
+    if (align <= (1 << PAGE_SHIFT))
+    {
+        return ConcurrentAlloc(alignSize);
+    }
+
+    size_t kpage = alignSize >> PAGE_SHIFT; // align是页的整数倍，alignSize也是
+
+    PageCache *pc = PageCache::GetInstance();
+    pc->_pageMtx.lock();
+    Span *span = pc->NewSpanAligned(kpage, align >> PAGE_SHIFT);
+    span->_isUse = true;
+    span->_isLarge = true; // 可能不超过256KB，不能按_objSize判断
+    span->_objSize = kpage << PAGE_SHIFT;
+    pc->_pageMtx.unlock();
+
+    void *obj = (void *)(span->_pageID << PAGE_SHIFT);
+    AllocTrace::Record(TRACE_ALLOC, obj, alignSize);
+    return obj;
+}
+
+/// @brief 将直接分配给用户的页级Span还给所属的pc分片，超过128页时pc会直接还给系统
+void ReleaseLargeSpan(Span *span)
+{
+    if (span->_sample)
+        HeapProfiler::RecordFree(span);
+
+    PageCache *pc = PageCache::GetInstance(span); // 可能是其它线程申请的，还给所属分片
+    pc->_pageMtx.lock();
+    pc->ReleaseSpanToPageCache(span);
+    pc->_pageMtx.unlock();
+}
+
+/// @brief 将不超过MAX_BYTES的块还给tc（或每CPU缓存）
+static inline void DeallocateSmall(void *obj, size_t size)
+{
+#ifdef PER_CPU_CACHE
+    CpuCache::GetInstance()->Deallocate(obj, size);
+#else
+    // 只释放不申请的线程（例如消费者线程）也需要自己的tc
+    if (pTLSThreadCache == nullptr)
+    {
+        ThreadCache::Create();
     }
 
-    return pTLSThreadCache->Allocate(size);
+    pTLSThreadCache->Deallocate(obj, size);
+#endif
 }
 
 /// @brief 线程回收空间的函数
+/// @details size必须等于申请时的大小，ConcurrentAllocAligned得到的块要传向上取整到align倍数后的大小
 void ConcurrentFree(void *obj, size_t size)
 {
     assert(obj);
-    pTLSThreadCache->Deallocate(obj, size);
+    AllocTrace::Record(TRACE_FREE, obj, size);
+
+#ifdef GUARDED_ALLOC
+    Span *span = AllocGuard::CheckFree(obj, size); // 调试模式总要查页号映射，顺便得到实际的块类型
+    if (span->_isLarge)
+        ReleaseLargeSpan(span);
+    else
+        DeallocateSmall(obj, span->_objSize);
+#else
+    if (size > MAX_BYTES)
+    { // 大块空间直接还给pc
+        ReleaseLargeSpan(PageCache::MapObjectToSpan(obj));
+        return;
+    }
+
+    if ((size & ((1 << PAGE_SHIFT) - 1)) == 0 || HeapProfiler::Active())
+    { // 页整数倍的大小可能是超过一页对齐申请的整Span，开启过堆采样后小块也可能是单独占用Span的采样块，
+      // 都需要查一次页号映射，顺便按Span记录的块大小归还
+        Span *span = PageCache::MapObjectToSpan(obj);
+        if (span->_isLarge)
+        {
+            ReleaseLargeSpan(span);
+            return;
+        }
+        assert(span->_objSize == SizeClass::RoundUp(size));
+        size = span->_objSize;
+    }
+    else
+    { // 其余大小不查映射，传错尺寸类会把块挂到别的桶里
+        assert(!PageCache::MapObjectToSpan(obj)->_isLarge &&
+               PageCache::MapObjectToSpan(obj)->_objSize == SizeClass::RoundUp(size));
+    }
+
+    DeallocateSmall(obj, size);
+#endif
+}
+
+/// @brief 线程回收空间的函数，块大小通过页号映射到的Span获取
+void ConcurrentFree(void *obj)
+{
+    assert(obj);
+    AllocTrace::Record(TRACE_FREE, obj, 0);
+#ifdef GUARDED_ALLOC
+    Span *span = AllocGuard::CheckFree(obj, 0);
+#else
+    Span *span = PageCache::MapObjectToSpan(obj); // 基数树查找，不加锁
+#endif
+    if (span->_isLarge)
+    {
+        ReleaseLargeSpan(span);
+        return;
+    }
+    DeallocateSmall(obj, span->_objSize);
+}
+
+/// @brief 一次回收objs中n块大小都为size的空间
+/// @details 在块中串成链表后一次挂到tc的自由链表上，超出上限的部分整批还给cc
+void ConcurrentFreeBatch(void **objs, size_t n, size_t size)
+{
+    if (n == 0)
+        return;
+
+#ifndef GUARDED_ALLOC
+    // 大块、页整数倍大小（可能是对齐申请的整Span）、以及开启堆采样后可能混有单独占用Span的采样块，只能逐个释放
+    if (size <= MAX_BYTES && (size & ((1 << PAGE_SHIFT) - 1)) != 0 && !HeapProfiler::Active())
+    {
+        if constexpr (TRACE_ENABLED)
+        {
+            for (size_t i = 0; i < n; ++i)
+                AllocTrace::Record(TRACE_FREE, objs[i], size);
+        }
+
+#ifdef PER_CPU_CACHE
+        CpuCache::GetInstance()->DeallocateBatch(objs, n, size);
+#else
+        if (pTLSThreadCache == nullptr)
+        {
+            ThreadCache::Create();
+        }
+
+        pTLSThreadCache->DeallocateBatch(objs, n, size);
+#endif
+        return;
+    }
+#endif
+
+    // 调试模式下逐个检查
+    for (size_t i = 0; i < n; ++i)
+        ConcurrentFree(objs[i], size);
+}
+
+/// @brief 将PageCache各分片中所有空闲页还给系统，完全合并的区域直接解除映射
+/// @details 先清空各节点cc的中转缓存，让其中的块回到Span，空闲的Span才能还给pc
+///          每CPU缓存模式下各槽由所有线程共用，这里先把槽中缓存的块也还给cc
+void ConcurrentReleaseFreeMemory()
+{
+#ifdef PER_CPU_CACHE
+    CpuCache::GetInstance()->Drain();
+#endif
+
+    for (size_t i = 0; i < Numa::NodeCount(); ++i)
+    {
+        CentralCache::GetNode(i)->FlushTransferCaches();
+    }
+
+    for (size_t i = 0; i < ARENA_NUM; ++i)
+    {
+        PageCache *pc = PageCache::GetArena(i);
+        pc->_pageMtx.lock();
+        pc->ReleaseIdleSpans(true);
+        pc->_pageMtx.unlock();
+    }
+}
+
+/// @brief 设置堆采样的平均间隔（字节），0表示关闭
+/// @details 开启后每申请约bytes字节采样一次，记录调用栈；其它线程在各自当前的倒计时结束后生效
+void SetHeapProfileSampleRate(size_t bytes)
+{
+    HeapProfiler::SetSampleRate(bytes);
+}
+
+/// @brief 把堆采样以pprof兼容的格式写到fd中，包括存活和累计两组数据，可用pprof --inuse_space/--alloc_space查看
+void DumpHeapProfile(int fd)
+{
+    HeapProfiler::Dump(fd);
+}
+
+/// @brief 开始把申请和释放事件写入fd，编译时需要定义ALLOC_TRACE
+/// @details 文件格式见AllocTrace.h；事件由后台线程写出，fd在StopAllocTrace之前需保持打开
+/// @return 未开启追踪编译选项或已经在追踪时返回false
+bool StartAllocTrace(int fd)
+{
+    return AllocTrace::Start(fd);
+}
+
+/// @brief 停止追踪并写出剩余的事件，不关闭fd
+/// @return 因缓冲区满而丢弃的事件数；追踪文件不完整（扩展、截断或写入事件数失败）时返回AllocTrace::STOP_FAILED
+size_t StopAllocTrace()
+{
+    return AllocTrace::Stop();
+}
+
+/// @brief 通知所有线程把各自tc中缓存的块还给cc
+/// @details 调用线程立即清空，其它线程在下一次回收或向cc补充时清空
+///          每CPU缓存模式下没有每线程的tc，直接逐槽加锁清空
+void ReleaseAllThreadCaches()
+{
+#ifdef PER_CPU_CACHE
+    CpuCache::GetInstance()->Drain();
+#else
+    ThreadCache::RequestDrainAll();
+    if (pTLSThreadCache)
+        pTLSThreadCache->Drain();
+#endif
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef CPU_CACHE_H
+#define CPU_CACHE_H
+
+#include "Common.h"
+#include "ThreadCache.h"
+
+// x86-64和aarch64上、glibc提供rseq注册信息（2.35起）时编译rseq快速路径
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#define CPU_CACHE_RSEQ 1
+#endif
+#endif
+
+// 每个CPU一份缓存，取代每个线程一份的ThreadCache
+// 线程数远多于核数时，缓存的总量随核数而不是线程数增长
+// 编译时定义PER_CPU_CACHE后，ConcurrentAlloc/ConcurrentFree改走这一层
+//
+// 两条路径在首次使用时选定：
+// - rseq：每个槽按桶各有一个指针数组，申请和释放在rseq临界区中弹出或压入一个指针，不加锁；
+//   线程在临界区中被抢占、迁移或收到信号时由内核跳到中止处重来。需要glibc已为线程注册rseq，
+//   并且能注册MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ，供Drain打断其它CPU上正在执行的临界区
+// - 加锁：槽按sched_getcpu()选取，之后每一次申请和释放都要加该槽的互斥锁，共用一个槽的线程会在锁上竞争
+// 环境变量CONCURRENT_ALLOC_RSEQ=0强制使用加锁路径；rseq模式下个别线程拿不到有效的CPU编号时也退回加锁路径
+class CpuCache
+{
+public:
+    static CpuCache *GetInstance()
+    {
+        return &_sInst;
+    }
+
+    void *Allocate(size_t size);             // 从当前CPU的缓存中申请size大小的空间
+    void Deallocate(void *obj, size_t size); // 回收到当前CPU的缓存中
+    void AllocateBatch(size_t size, void **objs, size_t n);   // 从当前CPU的缓存中申请n块
+    void DeallocateBatch(void **objs, size_t n, size_t size); // 回收n块到当前CPU的缓存中
+
+    void Drain();                             // 逐槽加锁，把各槽中缓存的块全部还给cc
+    void CollectStats(AllocatorStats &stats); // 逐槽加锁，汇总各槽中缓存的块
+    void ForkLock();                          // fork前按槽下标依次持有所有槽锁
+    void ForkUnlock();                        // fork后在父子进程中释放所有槽锁
+
+    size_t SlotNum()
+    {
+        InitSlots();
+        return _slotNum;
+    }
+
+    /// @brief 是否走rseq路径，首次使用时确定
+    bool RseqEnabled()
+    {
+        InitSlots();
+        return _rseq;
+    }
+
+private:
+    /// @brief 一个CPU对应的缓存槽，按缓存行对齐避免伪共享
+    struct alignas(64) Slot
+    {
+        std::mutex _mtx;    // 加锁路径：线程可能在持有期间被迁移到其它CPU，因此仍需要槽锁
+        ThreadCache _cache; // 加锁路径：复用tc的自由链表、慢开始和归还逻辑
+
+        // rseq路径：只在该CPU上的临界区中修改，Drain设置_stopped并打断临界区后才由其它线程访问
+        size_t _stopped = 0;                // 非0时临界区直接失败，线程到_mtx上等待
+        size_t _counts[FREE_LIST_NUM] = {}; // 各桶数组中的块数
+        void **_objs = nullptr;             // 各桶的指针数组首尾相接，桶i从_objs + _offsets[i]开始
+    };
+
+    Slot &CurrentSlot(); // 当前线程所在CPU对应的槽
+
+    /// @brief 首次使用时申请并构造所有槽，之后只是一次读取
+    void InitSlots()
+    {
+        if (!_ready.load(std::memory_order_acquire))
+            InitSlotsOnce();
+    }
+    void InitSlotsOnce(); // 由pthread_once保证只执行一次，完成后设置_ready
+
+#ifdef CPU_CACHE_RSEQ
+    bool RseqPop(size_t index, void *&obj);     // 从当前CPU桶index的数组弹出一块，数组为空时返回false
+    bool RseqPush(size_t index, void *obj);     // 压入当前CPU桶index的数组，数组已满时返回false
+    void *RseqRefill(size_t index);             // 数组为空：从cc取一批，返回第一块，其余压入数组
+    void RseqOverflow(size_t index, void *obj); // 数组已满：连同obj弹出约半个数组还给cc
+    void RseqDrainSlot(Slot &slot);             // 已打断临界区后，把slot中各数组的块还给cc
+#endif
+
+private:
+    constexpr CpuCache() {}; // 编译期初始化，malloc可能早于任何动态初始化被调用
+    CpuCache(CpuCache &copy) = delete;
+    CpuCache &operator=(CpuCache &copy) = delete;
+
+private:
+    Slot *_slots = nullptr;                // 按CPU编号下标访问
+    size_t _slotNum = 0;                   // 槽数量，等于系统配置的CPU数
+    bool _rseq = false;                    // 是否走rseq路径
+    uint32_t _caps[FREE_LIST_NUM] = {};    // rseq路径：各桶数组的容量
+    uint32_t _offsets[FREE_LIST_NUM] = {}; // rseq路径：各桶数组在槽的_objs中的起点
+    pthread_once_t _initOnce = PTHREAD_ONCE_INIT;
+    std::atomic<bool> _ready{false}; // 槽和路径选择都已完成
+
+    static CpuCache _sInst; // 饿汉模式创建一个CpuCache
+};
+
+#endif
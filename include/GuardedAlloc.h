@@ -0,0 +1,121 @@
+#ifndef GUARDED_ALLOC_H
+#define GUARDED_ALLOC_H
+
+// 调试模式：编译时定义GUARDED_ALLOC开启，未定义时本文件为空，申请和释放路径上没有任何额外代码
+// 1. 释放时通过页号映射核对指针确实属于内存池、指向块的起始位置、size与Span的尺寸类一致
+// 2. cc切分Span时为其分配一张位图，每块一位，交给用户时置位、释放时清零，清零前已为0即为重复释放
+// 3. 再定义GUARDED_ALLOC_POISON时，块在切分和释放时填充毒值，再次交给用户前检查毒值是否被改写（释放后写）
+// 发现错误时向stderr输出原因和地址后abort，使崩溃发生在出错的位置而不是之后某次使用自由链表时
+#ifdef GUARDED_ALLOC
+
+#include "PageCache.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+class AllocGuard
+{
+public:
+    static const unsigned char POISON = 0xdd; // 空闲块的填充值
+
+    /// @brief cc切分新Span前调用：分配位图，开启毒值时填满整个Span
+    static void OnCarve(Span *span)
+    {
+        size_t words = (Capacity(span) + 63) / 64;
+        size_t k = (words * sizeof(uint64_t) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        span->_allocBits = (std::atomic<uint64_t> *)SystemAlloc(k); // 匿名映射，初始全为0
+#ifdef GUARDED_ALLOC_POISON
+        memset((void *)(span->_pageID << PAGE_SHIFT), POISON, span->_n << PAGE_SHIFT);
+#endif
+    }
+
+    /// @brief 所有块都还回Span、Span还给pc之前调用：释放位图
+    static void OnRelease(Span *span)
+    {
+        size_t words = (Capacity(span) + 63) / 64;
+        size_t k = (words * sizeof(uint64_t) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        SystemFree(span->_allocBits, k);
+        span->_allocBits = nullptr;
+    }
+
+    /// @brief 小块交给用户前调用：置位，开启毒值时检查空闲期间是否被改写
+    static void OnAlloc(void *obj)
+    {
+        Span *span = PageCache::MapObjectToSpan(obj);
+        if (span->_isLarge)
+            return; // 堆采样单独分配的Span，没有位图
+
+        size_t i = ((char *)obj - (char *)(span->_pageID << PAGE_SHIFT)) / span->_objSize;
+        uint64_t bit = (uint64_t)1 << (i % 64);
+        if (span->_allocBits[i / 64].fetch_or(bit, std::memory_order_relaxed) & bit)
+            Fail("allocating a block that is still in use (free list corrupted)", obj, span->_objSize);
+
+#ifdef GUARDED_ALLOC_POISON
+        // 前一个指针大小的位置存放自由链表的next，其余部分应保持毒值
+        const unsigned char *p = (const unsigned char *)obj;
+        for (size_t j = sizeof(void *); j < span->_objSize; ++j)
+        {
+            if (p[j] != POISON)
+                Fail("write after free", p + j, span->_objSize);
+        }
+#endif
+    }
+
+    /// @brief 释放前调用，检查不通过时abort
+    /// @param size 调用者给出的大小，0表示不带大小的释放
+    /// @return obj所属的Span，小块已在位图中标记为空闲
+    static Span *CheckFree(void *obj, size_t size)
+    {
+        Span *span = PageCache::_idSpanMap.get((PageID)obj >> PAGE_SHIFT);
+        if (span == nullptr)
+            Fail("freeing a pointer not allocated by the pool", obj, size);
+
+        char *start = (char *)(span->_pageID << PAGE_SHIFT);
+        if (!span->_isUse)
+            Fail("freeing memory that is already free (double free?)", obj, size);
+
+        if (span->_isLarge)
+        {
+            if ((char *)obj != start)
+                Fail("freeing an interior pointer of a large block", obj, size);
+            if (size > MAX_BYTES && SizeClass::RoundUp(size) > span->_objSize)
+                Fail("size larger than the allocated block", obj, size);
+            return span;
+        }
+
+        if (span->_allocBits == nullptr)
+            Fail("freeing memory that is already free (double free?)", obj, size);
+        if (size && SizeClass::RoundUp(size) != span->_objSize)
+            Fail("size does not match the block's size class", obj, size);
+
+        size_t offset = (char *)obj - start;
+        if (offset % span->_objSize != 0)
+            Fail("freeing an interior pointer", obj, size);
+
+        size_t i = offset / span->_objSize;
+        uint64_t bit = (uint64_t)1 << (i % 64);
+        if ((span->_allocBits[i / 64].fetch_and(~bit, std::memory_order_relaxed) & bit) == 0)
+            Fail("double free", obj, size);
+
+#ifdef GUARDED_ALLOC_POISON
+        memset(obj, POISON, span->_objSize);
+#endif
+        return span;
+    }
+
+private:
+    static size_t Capacity(Span *span)
+    {
+        return (span->_n << PAGE_SHIFT) / span->_objSize;
+    }
+
+    [[noreturn]] static void Fail(const char *what, const void *obj, size_t size)
+    {
+        fprintf(stderr, "ConcurrentMemoryPool: %s: %p (size %zu)\n", what, obj, size);
+        abort();
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+
+#include "Common.h"
+#include "ObjectPool.h"
+
+// 采样式堆分析
+// 每个线程维护一个字节倒计时，每次申请减去申请大小，减到负数才进入慢路径，平均每SampleRate字节采样一次
+// 被采样的申请单独占用一个页级Span（_isLarge），采样记录挂在Span::_sample上，
+// 释放时通过页号映射找到Span即可找到记录，不需要额外的哈希表
+// 调用栈相同的采样合并到同一个Bucket中，同时累计存活量和累计申请量，按pprof的heap_v2文本格式输出
+class HeapProfiler
+{
+public:
+    /// @brief 快速路径：扣减本线程的采样倒计时，减到负数时返回true
+    static bool ShouldSample(size_t size)
+    {
+        return (_tBytesUntilSample -= (ptrdiff_t)size) < 0;
+    }
+
+    /// @brief 慢路径：重新抽取倒计时，需要采样时为size申请一个单独的Span并记录调用栈
+    /// @return 没有采样（采样关闭或重入）时返回nullptr，调用者继续走普通路径
+    static void *SampleAlloc(size_t size);
+
+    /// @brief 释放被采样的Span前调用，从存活量中扣除并清空span->_sample
+    static void RecordFree(Span *span);
+
+    /// @brief 是否开启过采样，开启后按大小释放的小块也要检查是否为采样块
+    static bool Active()
+    {
+        return _active.load(std::memory_order_relaxed);
+    }
+
+    /// @brief 设置平均采样间隔（字节），0表示关闭
+    static void SetSampleRate(size_t bytes);
+
+    static size_t SampleRate()
+    {
+        return _sampleRate.load(std::memory_order_relaxed);
+    }
+
+    /// @brief 以pprof兼容的heap_v2格式写出存活和累计的采样，不申请堆内存
+    static void Dump(int fd);
+
+    // fork前持有_mtx，fork后在父子进程中释放
+    static void ForkLock()
+    {
+        _mtx.lock();
+    }
+
+    static void ForkUnlock()
+    {
+        _mtx.unlock();
+    }
+
+private:
+    static const size_t MAX_DEPTH = 32;                 // 记录的最大栈深度
+    static const size_t BUCKET_NUM = 4096;              // 调用栈哈希表的桶数
+    static const ptrdiff_t RECHECK_BYTES = 1 << 20;     // 采样关闭时，每申请这么多字节重新检查一次开关
+
+    /// @brief 一个调用栈上的累计量
+    struct Bucket
+    {
+        size_t _hash;
+        size_t _depth;
+        void *_stack[MAX_DEPTH];
+        size_t _allocCount; // 累计采样次数
+        size_t _allocBytes; // 累计采样字节数
+        size_t _liveCount;  // 尚未释放的采样次数
+        size_t _liveBytes;  // 尚未释放的采样字节数
+        Bucket *_next;      // 哈希冲突链
+    };
+
+    /// @brief 一次被采样的申请
+    struct Sample
+    {
+        Bucket *_bucket;
+        size_t _size; // 用户申请的大小
+    };
+
+    static void PickNextSample();                          // 按指数分布抽取下一次采样前的字节数
+    static Bucket *FindBucket(void **stack, size_t depth); // 查找或创建调用栈对应的Bucket，需持有_mtx
+
+private:
+    static __thread ptrdiff_t _tBytesUntilSample; // 本线程距离下一次采样还需申请的字节数
+    static __thread bool _tInSample;              // 正在采样，防止backtrace内部的申请重入
+    static __thread uint64_t _tRand;              // 本线程的随机数状态
+
+    static std::atomic<size_t> _sampleRate; // 平均采样间隔
+    static std::atomic<bool> _active;       // 是否开启过采样
+    static std::mutex _mtx;                 // 保护哈希表和两个内存池
+    static Bucket *_table[BUCKET_NUM];
+    static ObjectPool<Bucket> _bucketPool;
+    static ObjectPool<Sample> _samplePool;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "Common.h"
+#include <pthread.h>
+
+// NUMA拓扑
+// 节点数从/sys/devices/system/node/online读取，线程首次绑定PageCache分片时通过getcpu取得所在节点
+// PageCache的分片按下标轮流分给各节点（分片i属于节点i % 节点数），CentralCache每个节点一份，
+// 线程只绑定本节点的分片，补充和归还都在本节点内完成
+// 设置环境变量CONCURRENT_ALLOC_NUMA_NODES=n可以在单节点机器上模拟n个节点：
+// 线程按到达顺序轮流分到各节点，新区域不做mbind，其它行为与真实的多节点相同
+class Numa
+{
+public:
+    /// @brief 节点数，不超过NUMA_NODE_NUM，单节点机器上为1
+    static size_t NodeCount()
+    {
+        pthread_once(&_initOnce, Init);
+        return _nodeCount;
+    }
+
+    /// @brief 是否为模拟的节点
+    static bool Simulated()
+    {
+        pthread_once(&_initOnce, Init);
+        return _simulated;
+    }
+
+    /// @brief 当前线程所在的节点，超过NodeCount的节点号按取模合并
+    static size_t CurrentNode();
+
+    /// @brief 让从ptr开始的k页优先从node节点分配物理页，模拟节点或单节点时什么也不做
+    /// @details 使用MPOL_PREFERRED而不是MPOL_BIND，节点内存不足时仍可以从其它节点分配
+    static void BindToNode(void *ptr, size_t k, size_t node);
+
+private:
+    static void Init();
+
+    static size_t _nodeCount;
+    static bool _simulated;
+    static pthread_once_t _initOnce;
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+
+#include "Common.h"
+
+/// @brief 定长内存池，直接从SystemAlloc的页中切分T大小的块，用于Span、基数树节点等元数据
+/// @details 本身不加锁，由使用者所在的锁保护（例如PageCache的_pageMtx）
+template <class T>
+class ObjectPool
+{
+public:
+    /// @brief 申请一个T类型大小的空间
+    /// @return T类型指针
+    T *New()
+    {
+        T *obj = nullptr; // 最终返回的指针
+
+        if (_freelist)
+        {                                 // 自由链表不为空，表示有回收的T大小的小块可以重复利用
+            void *next = ObjNext(_freelist); // 获取自由链表第一块的前(一个指针大小)的内存内容，即下一块的起始地址
+            obj = (T *)_freelist;
+            _freelist = next; // 头删
+        }
+        else
+        {
+            // 一个块的大小至少为一个指针的大小，所以可能会有内存碎片
+            size_t objSize = sizeof(T) < sizeof(void *) ? sizeof(void *) : sizeof(T);
+
+            if (_remanentBytes < objSize)
+            { // 如果剩余字节数不够才申请空间，至少申请128KB，按页向系统申请
+                size_t bytes = objSize < 128 * 1024 ? 128 * 1024 : objSize;
+                size_t k = (bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+                _memory = (char *)SystemAlloc(k); // 失败时抛出bad_alloc
+                _remanentBytes = k << PAGE_SHIFT;
+            }
+
+            obj = (T *)_memory;        // 给定一个T类型大小的空间
+            _memory += objSize;        // 空闲空间指针后移T类型大小
+            _remanentBytes -= objSize; // 剩余字节数减去分配的T类型大小
+        }
+
+        new (obj) T(); // 通过placement new值初始化，没有用户构造函数的成员也会被清零
+        return obj;
+    }
+
+    /// @brief 回收还回来的小空间
+    /// @param obj 待回收空间
+    void Delete(T *obj)
+    {
+        obj->~T();
+
+        // 头插，覆盖obj指向内存空间的前(一个指针大小)的空间
+        ObjNext(obj) = _freelist; // 新块指向旧块
+        _freelist = obj;          // 头指针指向新块
+    }
+
+private:
+    char *_memory = nullptr;   // 指向内存块的指针
+    size_t _remanentBytes = 0; // 大块内存空间在切分过程中的剩余字节数
+    void *_freelist = nullptr; // 自由链表，用于连接归还的空闲空间
+};
+
+#endif
@@ -2,39 +2,149 @@
 #define PAGE_CACHE
 
 #include "Common.h"
-#include <unordered_map>
+#include "AllocatorStats.h"
+#include "PageMap.h"
+#include "ObjectPool.h"
+#include "Numa.h"
+#include <atomic>
 
 // 向PageCache申请Span，假设要申请4页
 // 1.查看_spanLists[4]是否有空闲Span，有则分配，没有就下一步
 // 2.向更大的页数对应的自由链表申请，有就把Span分成两块，没有就向系统申请（mmap/brk/VirtualAlloc）128页page Span，重复第一步
+//
+// PageCache分成ARENA_NUM个互相独立的分片，各自有锁和_spanLists
+// 开启HUGEPAGE_SPANS时以2MB对齐的大页为单位向系统申请并madvise(MADV_HUGEPAGE)，小Span优先从已部分使用的大页中切，
+// 回收时只整个归还完全空闲的大页，避免把大页拆散成4KB页
+// 分片i属于NUMA节点i % 节点数，线程在所在节点的分片中按到达顺序轮流绑定一个，分片向系统申请的区域优先放在所属节点上
+// 每个分片以128页对齐的区域为单位向系统申请，区域整个归属于一个分片
+// 合并只在同一个128页对齐区域内进行，因此相邻页一定属于同一个分片，合并时不需要碰其它分片的锁
 class PageCache
 {
 public:
+    // 当前线程绑定的分片
     static PageCache *GetInstance()
     {
-        return &_sInst;
+        if (_tArena == nullptr)
+        {
+            static std::atomic<size_t> next[NUMA_NODE_NUM];
+            size_t nodes = Numa::NodeCount();
+            size_t node = Numa::CurrentNode();
+            size_t count = (ARENA_NUM - node + nodes - 1) / nodes; // 属于该节点的分片数
+            size_t i = next[node].fetch_add(1, std::memory_order_relaxed) % count;
+            _tArena = &_sInst[node + i * nodes];
+        }
+        return _tArena;
+    }
+
+    // span所属的分片，归还span时必须交给这个分片
+    static PageCache *GetInstance(Span *span)
+    {
+        return &_sInst[span->_arena];
+    }
+
+    // 第i个分片
+    static PageCache *GetArena(size_t i)
+    {
+        return &_sInst[i];
     }
 
     // pc中_spanLists从取出一个管理着k页的Span
     Span *NewSpan(size_t k);
-    // 通过页地址找到Span
-    Span *MapObjectToSpan(void *obj);
+    // 申请一个起始页按alignPages页对齐的k页Span，alignPages为2的幂
+    Span *NewSpanAligned(size_t k, size_t alignPages);
+    // 通过页地址找到Span，不需要加锁
+    static Span *MapObjectToSpan(void *obj);
     // 管理cc归还回来的span
     void ReleaseSpanToPageCache(Span *span);
+    // 将pc中空闲了一个回收周期以上的Span还给系统，force为true时不看空闲时长
+    void ReleaseIdleSpans(bool force = false);
+    // 统计本分片的空闲Span和锁的使用情况，需要持有_pageMtx
+    void CollectStats(ArenaStats &stats);
+
+    // 本分片所属的NUMA节点
+    size_t Node()
+    {
+        return ArenaIndex() % Numa::NodeCount();
+    }
 
 private:
     SpanList _spanLists[PAGE_NUM + 1]; // PageCache中的哈希自由链表，以页为单位管理，下标代表一个Span管理的页数
+    size_t _scavengeEpoch = 0;         // 当前回收周期编号
+    size_t _pagesSinceScavenge = 0;    // 上次回收以来还回pc的页数
+    ObjectPool<Span> _spanPool;        // Span元数据的定长内存池，在_pageMtx下使用
+#ifdef HUGEPAGE_SPANS
+    HugePage *_hugePages = nullptr;    // 本分片持有的大页
+    ObjectPool<HugePage> _hugePool;    // 大页元数据的定长内存池
+#endif
 
 public:
-    std::mutex _pageMtx;                           // PageCache整体锁，这里不用桶锁是因为tc向PageCache申请Span时，可能会涉及多个桶
-    std::unordered_map<PageID, Span *> _idSpanMap; // 页号到Span的快速映射表，只有分配出去的Span才需要记录
+    CountingMutex _pageMtx;                     // 分片锁，这里不用桶锁是因为tc向PageCache申请Span时，可能会涉及多个桶
+    static PageMap<48 - PAGE_SHIFT> _idSpanMap; // 页号到Span的基数树映射，所有分片共用，读不加锁
 
 private:
-    PageCache() {};
+    constexpr PageCache() {};
+
+    // 为直接向系统申请的超过128页的空间创建Span
+    Span *NewHugeSpan(void *ptr, size_t k);
+    // 从已摘下的空闲span中切出从pageID开始的k页，前后剩余部分挂回_spanLists
+    Span *SplitSpan(Span *span, PageID pageID, size_t k);
+    // 选出用来切k页Span的桶下标，没有可用的Span时返回0
+    size_t FindFreeList(size_t k);
+    // 向系统申请一块新的区域挂入_spanLists：默认为128页，开启大页时为一个2MB大页
+    void NewRegion();
+#ifdef HUGEPAGE_SPANS
+    // 将完全空闲的大页整个还给系统
+    void ReleaseHugePage(HugePage *huge);
+#endif
+
+    // 把空闲Span挂回对应的桶；开启大页时完全空闲的大页中的Span排在最后，其余排在最前
+    void PushFree(Span *span)
+    {
+#ifdef HUGEPAGE_SPANS
+        SpanList &list = _spanLists[span->_n];
+        if (span->_huge && span->_huge->_usedPages == 0)
+            list.insert(list.end(), span);
+        else
+            list.insert(list.begin(), span);
+#else
+        _spanLists[span->_n].push_front(span);
+#endif
+    }
+
+    // 记录span所在大页中分配出去的页数，未开启大页时什么也不做
+    void AddUsedPages(Span *span, ptrdiff_t n)
+    {
+#ifdef HUGEPAGE_SPANS
+        if (span->_huge)
+            span->_huge->_usedPages += n;
+#else
+        (void)span;
+        (void)n;
+#endif
+    }
+
+    // 让刚向系统申请的k页优先放在本分片所属的节点上，返回ptr
+    void *BindLocal(void *ptr, size_t k)
+    {
+        Numa::BindToNode(ptr, k, Node());
+        return ptr;
+    }
+
+    // 本分片的下标
+    size_t ArenaIndex()
+    {
+        return this - _sInst;
+    }
+
     PageCache(PageCache &copy) = delete;
     PageCache &operator=(PageCache &copy) = delete;
 
-    static PageCache _sInst; // 单例PageCache对象
+    static PageCache _sInst[ARENA_NUM]; // 各分片对象
+    static __thread PageCache *_tArena; // 当前线程绑定的分片
 };
 
+/// @brief 登记pthread_atfork处理函数：fork前按固定顺序持有内存池的所有锁，父子进程中再全部释放
+/// @details 定义在AtFork.cpp中
+void RegisterForkHandlers();
+
 #endif
\ No newline at end of file
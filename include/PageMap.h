@@ -0,0 +1,113 @@
+#ifndef PAGE_MAP_H
+#define PAGE_MAP_H
+
+#include "Common.h"
+#include "ObjectPool.h"
+#include <atomic>
+
+/// @brief 页号到Span的三层基数树映射
+/// @details 48位地址空间、4KB页时页号共36位，每层各取12位
+///          读（get）不加锁、不等待；写（set）只由PageCache在各分片的_pageMtx下完成
+///          节点从定长内存池中申请，一旦挂上就不会移动或释放，因此读者看到的指针始终有效
+template <int BITS>
+class PageMap
+{
+private:
+    static const int INTERIOR_BITS = (BITS + 2) / 3; // 第一、二层的位数
+    static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
+    static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS; // 第三层的位数
+    static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+    struct Leaf
+    {
+        std::atomic<Span *> values[LEAF_LENGTH];
+    };
+
+    struct Node
+    {
+        std::atomic<Node *> ptrs[INTERIOR_LENGTH];
+    };
+
+public:
+    /// @brief 查找页号id对应的Span，未映射时返回nullptr
+    Span *get(PageID id) const
+    {
+        if ((id >> BITS) > 0)
+            return nullptr;
+
+        const size_t i1 = id >> (LEAF_BITS + INTERIOR_BITS);
+        const size_t i2 = (id >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        const size_t i3 = id & (LEAF_LENGTH - 1);
+
+        Node *n2 = _root.ptrs[i1].load(std::memory_order_acquire);
+        if (n2 == nullptr)
+            return nullptr;
+        Leaf *leaf = (Leaf *)n2->ptrs[i2].load(std::memory_order_acquire);
+        if (leaf == nullptr)
+            return nullptr;
+        return leaf->values[i3].load(std::memory_order_acquire);
+    }
+
+    /// @brief 建立页号id到span的映射，span为nullptr时表示取消映射
+    /// @details 调用者需持有id所在分片的_pageMtx，不同分片管理的页互不重叠
+    ///          缺失的中间节点可能被多个分片同时需要，创建时单独加锁
+    void set(PageID id, Span *span)
+    {
+        assert((id >> BITS) == 0);
+
+        const size_t i1 = id >> (LEAF_BITS + INTERIOR_BITS);
+        const size_t i2 = (id >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        const size_t i3 = id & (LEAF_LENGTH - 1);
+
+        Node *n2 = _root.ptrs[i1].load(std::memory_order_acquire);
+        Leaf *leaf = n2 ? (Leaf *)n2->ptrs[i2].load(std::memory_order_acquire) : nullptr;
+        if (leaf == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(_growMtx);
+
+            // 加锁后重新检查，其它分片可能已经创建好了
+            n2 = _root.ptrs[i1].load(std::memory_order_relaxed);
+            if (n2 == nullptr)
+            {
+                n2 = _nodePool.New();                                // 值初始化后指针全部为空
+                _root.ptrs[i1].store(n2, std::memory_order_release); // 节点清零后再发布
+                ++_nodes;
+            }
+            leaf = (Leaf *)n2->ptrs[i2].load(std::memory_order_relaxed);
+            if (leaf == nullptr)
+            {
+                leaf = _leafPool.New();
+                n2->ptrs[i2].store((Node *)leaf, std::memory_order_release);
+                ++_nodes;
+            }
+        }
+        leaf->values[i3].store(span, std::memory_order_release);
+    }
+
+    // fork前持有_growMtx，fork后在父子进程中释放
+    void ForkLock()
+    {
+        _growMtx.lock();
+    }
+
+    void ForkUnlock()
+    {
+        _growMtx.unlock();
+    }
+
+    /// @brief 已创建的第二、三层节点数，供测试检查节点是否按需创建
+    size_t NodeCount()
+    {
+        std::lock_guard<std::mutex> lock(_growMtx);
+        return _nodes;
+    }
+
+private:
+    Node _root = {};            // 第一层常驻在PageCache单例中
+    ObjectPool<Node> _nodePool; // 第二层节点，只申请不释放
+    ObjectPool<Leaf> _leafPool; // 第三层节点，只申请不释放
+    std::mutex _growMtx;        // 保护节点创建和两个内存池
+    size_t _nodes = 0;          // 已创建的第二、三层节点数，在_growMtx下更新
+};
+
+#endif
@@ -3,21 +3,52 @@
 
 #include "Common.h"
 #include "CentralCache.h"
+#include "ObjectPool.h"
+#include <atomic>
+#include <pthread.h>
 
 class ThreadCache
 {
 public:
+    static ThreadCache *Create();                       // 为当前线程创建tc并设置pTLSThreadCache，登记到全局链表并挂上线程退出钩子
+    static void Destroy(ThreadCache *tc);               // 将tc中的块全部还给cc，从全局链表摘下后回收到池中
+    static void RequestDrainAll();                      // 通知所有存活的tc在下次回收或补充时清空自己
+    static void CollectAllStats(AllocatorStats &stats); // 汇总所有存活tc中缓存的块
+    static void ForkLock();                             // fork前持有_sMtx
+    static void ForkUnlock();                           // fork后在父子进程中释放_sMtx
+
+
     void *Allocate(size_t size);                                 // 线程申请size大小的空间
     void Deallocate(void *obj, size_t size);                     // 回收线程中大小为size、起始地址为obj的空间
+    void AllocateBatch(size_t size, void **objs, size_t n);      // 申请n块size大小的空间写入objs
+    void DeallocateBatch(void **objs, size_t n, size_t size);    // 回收objs中n块大小为size的空间
     void *FetchFromCentralCache(size_t index, size_t alignSize); // ThreadCache空间不够时，向CentralCache申请空间的接口
     void ListTooLong(FreeList &list, size_t size);               // tc向cc归还list桶中的空间
+    void Scavenge();                                             // 按低水位线收缩各个自由链表
+    void Drain();                                                // 将所有自由链表中的块还给cc
+    void CollectStats(AllocatorStats &stats);                    // 累加本tc各自由链表中缓存的块
+
+private:
+    void ReleaseToCentralCache(FreeList &list, size_t n, size_t size); // 从list中取出n块还给cc
+    static void ThreadExit(void *arg);                                 // 线程退出时由pthread调用
 
 private:
-    FreeList _freeLists[FREE_LIST_NUM]; // 每个桶表示一个自由链表
+    FreeList _freeLists[FREE_LIST_NUM];            // 每个桶表示一个自由链表
+    size_t _scavengeCountdown = TC_SCAVENGE_FREES; // 距离下一次收缩还需回收的块数
+    std::atomic<bool> _drainRequested{false};      // 其它线程请求清空，由本线程在慢路径上完成
+
+    ThreadCache *_prev = nullptr; // 全局链表中的前一个tc
+    ThreadCache *_next = nullptr; // 全局链表中的后一个tc
+
+    static ThreadCache *_sHead;            // 存活tc组成的全局链表
+    static std::mutex _sMtx;               // 保护全局链表和_sPool
+    static ObjectPool<ThreadCache> _sPool; // tc对象本身也从定长内存池中申请
+    static pthread_key_t _sKey;            // 线程退出时触发ThreadExit
+    static pthread_once_t _sKeyOnce;       // 保证_sKey只创建一次
 };
 
 // TLS的全局对象指针，每个线程下都有一个独立的全局对象
-static __thread ThreadCache *pTLSThreadCache = nullptr;
-// static修饰，避免链接冲突问题
+// 定义在ThreadCache.cpp中，所有翻译单元共享同一个变量，线程退出时置空才能被各处看到
+extern __thread ThreadCache *pTLSThreadCache;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,261 @@
+#include "../include/AllocTrace.h"
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+__thread AllocTrace::Ring *AllocTrace::_tRing = nullptr;
+__thread bool AllocTrace::_tDrainer = false;
+
+CONSTINIT std::atomic<bool> AllocTrace::_active{false};
+CONSTINIT std::atomic<bool> AllocTrace::_stop{false};
+CONSTINIT std::atomic<AllocTrace::Ring *> AllocTrace::_rings{nullptr};
+CONSTINIT std::atomic<uint16_t> AllocTrace::_ringNum{0};
+CONSTINIT std::mutex AllocTrace::_mtx;
+int AllocTrace::_fd = -1;
+char *AllocTrace::_window = nullptr;
+size_t AllocTrace::_windowOff = 0;
+size_t AllocTrace::_windowUsed = 0;
+uint64_t AllocTrace::_count = 0;
+uint64_t AllocTrace::_epoch = 0;
+pthread_t AllocTrace::_drainer;
+pthread_key_t AllocTrace::_key;
+pthread_once_t AllocTrace::_keyOnce = PTHREAD_ONCE_INIT;
+
+uint64_t AllocTrace::Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); // vDSO，不陷入内核
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// @brief 为当前线程取得一个缓冲区：优先复用已退出线程交还的，没有再新建
+AllocTrace::Ring *AllocTrace::AcquireRing()
+{
+    Ring *ring = nullptr;
+    for (Ring *r = _rings.load(std::memory_order_acquire); r; r = r->_next)
+    {
+        bool owned = false;
+        if (!r->_owned.load(std::memory_order_relaxed) &&
+            r->_owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+        {
+            ring = r;
+            break;
+        }
+    }
+
+    if (ring == nullptr)
+    { // 直接向系统申请，不经过内存池，未写到的页不会占用物理内存
+        size_t k = (sizeof(Ring) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        ring = new (SystemAlloc(k)) Ring;
+        ring->_thread = _ringNum.fetch_add(1, std::memory_order_relaxed);
+
+        Ring *head = _rings.load(std::memory_order_relaxed);
+        do
+        {
+            ring->_next = head;
+        } while (!_rings.compare_exchange_weak(head, ring, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // 先挂到TLS上：pthread_setspecific可能调用calloc，替换了malloc时会重入这里
+    _tRing = ring;
+    pthread_setspecific(_key, ring);
+    return ring;
+}
+
+void AllocTrace::ThreadExit(void *arg)
+{
+    _tRing = nullptr;
+    ((Ring *)arg)->_owned.store(false, std::memory_order_release);
+}
+
+void AllocTrace::Append(TraceOp op, void *obj, size_t size)
+{
+    if (_tDrainer)
+        return;
+
+    Ring *ring = _tRing;
+    if (ring == nullptr)
+        ring = AcquireRing();
+
+    size_t tail = ring->_tail.load(std::memory_order_relaxed);
+    if (tail - ring->_head.load(std::memory_order_acquire) == RING_SIZE)
+    { // 后台线程跟不上，丢弃而不是等待
+        ring->_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent &e = ring->_events[tail & (RING_SIZE - 1)];
+    e._time = Now() - _epoch;
+    e._ptr = (uint64_t)obj;
+    e._size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    e._thread = ring->_thread;
+    e._op = op;
+    e._pad = 0;
+    ring->_tail.store(tail + 1, std::memory_order_release);
+}
+
+/// @brief 解除当前窗口的映射，把文件扩展一个窗口并映射新增的部分
+/// @return 扩展或映射失败时返回false，_window为空，之后的事件全部丢弃
+bool AllocTrace::NextWindow()
+{
+    size_t off = 0;
+    if (_window)
+    {
+        munmap(_window, WINDOW_SIZE);
+        _window = nullptr;
+        off = _windowOff + WINDOW_SIZE;
+    }
+
+    if (ftruncate(_fd, off + WINDOW_SIZE) != 0)
+        return false;
+    void *ptr = mmap(nullptr, WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, off);
+    if (ptr == MAP_FAILED)
+        return false;
+
+    _window = (char *)ptr;
+    _windowOff = off;
+    _windowUsed = 0;
+    return true;
+}
+
+void AllocTrace::Emit(const TraceEvent *events, size_t n)
+{
+    while (n > 0 && _window)
+    {
+        if (_windowUsed == WINDOW_SIZE && !NextWindow())
+            return;
+
+        size_t k = std::min(n, (WINDOW_SIZE - _windowUsed) / sizeof(TraceEvent));
+        memcpy(_window + _windowUsed, events, k * sizeof(TraceEvent));
+        _windowUsed += k * sizeof(TraceEvent);
+        _count += k;
+        events += k;
+        n -= k;
+    }
+}
+
+/// @brief 把一个缓冲区中已写好的事件拷贝到文件中，环绕时分两段
+/// @details 文件映射失败时同样推进_head丢弃这些事件，不能让缓冲区一直满着
+void AllocTrace::DrainRing(Ring *ring)
+{
+    size_t head = ring->_head.load(std::memory_order_relaxed);
+    size_t tail = ring->_tail.load(std::memory_order_acquire);
+    if (head == tail)
+        return;
+
+    size_t begin = head & (RING_SIZE - 1);
+    size_t first = std::min(tail - head, RING_SIZE - begin);
+    Emit(&ring->_events[begin], first);
+    Emit(&ring->_events[0], tail - head - first);
+
+    ring->_head.store(tail, std::memory_order_release);
+}
+
+void AllocTrace::DrainLoop()
+{
+    _tDrainer = true;
+    while (!_stop.load(std::memory_order_acquire))
+    {
+        for (Ring *r = _rings.load(std::memory_order_acquire); r; r = r->_next)
+            DrainRing(r);
+
+        timespec ts = {0, 1000000};
+        nanosleep(&ts, nullptr);
+    }
+}
+
+bool AllocTrace::Start(int fd)
+{
+    if (!TRACE_ENABLED)
+        return false;
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    if (_fd >= 0)
+        return false;
+
+    // 丢弃上一次停止后残留的事件
+    for (Ring *r = _rings.load(std::memory_order_acquire); r; r = r->_next)
+    {
+        r->_head.store(r->_tail.load(std::memory_order_acquire), std::memory_order_release);
+        r->_dropped.store(0, std::memory_order_relaxed);
+    }
+
+    pthread_once(&_keyOnce, []()
+    {
+        pthread_key_create(&_key, ThreadExit);
+        pthread_atfork(nullptr, nullptr, AtForkChild);
+    });
+
+    _fd = fd;
+    _window = nullptr;
+    _windowUsed = 0;
+    _count = 0;
+    if (!NextWindow())
+    {
+        _fd = -1;
+        return false;
+    }
+
+    // 文件头占第一个事件的位置，事件数在停止时补上
+    TraceFileHeader *header = (TraceFileHeader *)_window;
+    memcpy(header->_magic, "CMPTRACE", sizeof(header->_magic));
+    header->_version = VERSION;
+    header->_eventSize = sizeof(TraceEvent);
+    header->_count = 0;
+    _windowUsed = sizeof(TraceFileHeader);
+
+    _epoch = Now();
+    _stop.store(false, std::memory_order_relaxed);
+    if (pthread_create(&_drainer, nullptr, [](void *) -> void *
+                       { DrainLoop(); return nullptr; }, nullptr) != 0)
+    {
+        munmap(_window, WINDOW_SIZE);
+        _window = nullptr;
+        _fd = -1;
+        return false;
+    }
+
+    _active.store(true, std::memory_order_release);
+    return true;
+}
+
+size_t AllocTrace::Stop()
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    if (_fd < 0)
+        return 0;
+
+    _active.store(false, std::memory_order_relaxed);
+    _stop.store(true, std::memory_order_release);
+    pthread_join(_drainer, nullptr);
+
+    // 后台线程已退出，最后写出一遍；此时仍在记录中的事件可能丢失
+    size_t dropped = 0;
+    for (Ring *r = _rings.load(std::memory_order_acquire); r; r = r->_next)
+    {
+        DrainRing(r);
+        dropped += r->_dropped.load(std::memory_order_relaxed);
+    }
+
+    // 补上事件数，截掉最后一个窗口中未用到的部分
+    // 窗口为空说明中途扩展或映射失败，之后的事件都没有写进文件；任何一步失败，文件都不完整
+    bool ok = _window != nullptr;
+    if (_window)
+        munmap(_window, WINDOW_SIZE);
+    _window = nullptr;
+    size_t bytes = (_count + 1) * sizeof(TraceEvent);
+    ok = ftruncate(_fd, bytes) == 0 && ok;
+    ok = ok && pwrite(_fd, &_count, sizeof(_count), offsetof(TraceFileHeader, _count)) == (ssize_t)sizeof(_count);
+
+    _fd = -1;
+    return ok ? dropped : STOP_FAILED;
+}
+
+/// @brief fork出的子进程只继承调用fork的线程，后台线程不存在，子进程中的事件不再记录
+void AllocTrace::AtForkChild()
+{
+    _active.store(false, std::memory_order_relaxed);
+    _window = nullptr;
+    _fd = -1;
+}
@@ -0,0 +1,168 @@
+#include "../include/AllocatorStats.h"
+#include "../include/ThreadCache.h"
+#include "../include/CentralCache.h"
+#include "../include/PageCache.h"
+#ifdef PER_CPU_CACHE
+#include "../include/CpuCache.h"
+#endif
+
+/// @brief 收集统计到stats中，stats需要是清零的状态
+static void CollectAllocatorStats(AllocatorStats &stats)
+{
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        stats._classes[i]._size = SizeClass::ClassSize(i);
+    }
+
+#ifdef PER_CPU_CACHE
+    CpuCache::GetInstance()->CollectStats(stats);
+#else
+    ThreadCache::CollectAllStats(stats);
+#endif
+
+    for (size_t i = 0; i < Numa::NodeCount(); ++i)
+    {
+        CentralCache::GetNode(i)->CollectStats(stats);
+    }
+
+    for (size_t i = 0; i < ARENA_NUM; ++i)
+    {
+        PageCache *pc = PageCache::GetArena(i);
+        pc->_pageMtx.lock();
+        pc->CollectStats(stats._arenas[i]);
+        pc->_pageMtx.unlock();
+    }
+
+    stats._mappedBytes = systemCounters._mappedBytes.load(std::memory_order_relaxed);
+    stats._unmappedBytes = systemCounters._unmappedBytes.load(std::memory_order_relaxed);
+    stats._releasedBytes = systemCounters._releasedBytes.load(std::memory_order_relaxed);
+}
+
+AllocatorStats GetAllocatorStats()
+{
+    AllocatorStats stats;
+    CollectAllocatorStats(stats);
+    return stats;
+}
+
+/// @brief 输出到调用者提供的缓冲区，空间不够时截断但继续累计需要的长度
+struct BufferOut
+{
+    char *_buf;
+    size_t _len;
+    size_t _need = 0;
+
+    void Printf(const char *fmt, ...)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        size_t left = _need < _len ? _len - _need : 0;
+        int n = vsnprintf(left ? _buf + _need : nullptr, left, fmt, ap);
+        va_end(ap);
+        if (n > 0)
+            _need += n;
+    }
+};
+
+/// @brief 文本表格：只列出有数据的桶和分片
+template <class Out>
+static void FormatText(const AllocatorStats &stats, Out &out)
+{
+    out.Printf("------------------------------------------------------------------------------------------\n");
+    out.Printf("system: mapped %zu B, unmapped %zu B, released %zu B, thread caches %zu\n",
+               stats._mappedBytes, stats._unmappedBytes, stats._releasedBytes, stats._threadCaches);
+
+    out.Printf("%5s %8s %10s %12s %10s %8s %10s %10s %12s %10s\n",
+               "class", "size", "tc_objs", "tc_bytes", "xfer_objs", "spans", "in_use", "free", "lock_acq", "lock_wait");
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        const SizeClassStats &cs = stats._classes[i];
+        if (cs._tcObjects == 0 && cs._spans == 0 && cs._lock._acquires == 0)
+            continue;
+        out.Printf("%5zu %8zu %10zu %12zu %10zu %8zu %10zu %10zu %12zu %10zu\n",
+                   i, cs._size, cs._tcObjects, cs._tcBytes, cs._transferObjects,
+                   cs._spans, cs._inUseObjects, cs._freeObjects, cs._lock._acquires, cs._lock._contended);
+    }
+
+    out.Printf("%5s %10s %12s %12s %10s   %s\n",
+               "arena", "free_pages", "returned", "lock_acq", "lock_wait", "free spans (pages:count)");
+    for (size_t i = 0; i < ARENA_NUM; ++i)
+    {
+        const ArenaStats &as = stats._arenas[i];
+        if (as._freePages == 0 && as._lock._acquires == 0)
+            continue;
+        out.Printf("%5zu %10zu %12zu %12zu %10zu  ",
+                   i, as._freePages, as._returnedPages, as._lock._acquires, as._lock._contended);
+        for (size_t k = 1; k <= PAGE_NUM; ++k)
+        {
+            if (as._freeSpans[k])
+                out.Printf(" %zu:%zu", k, as._freeSpans[k]);
+        }
+        out.Printf("\n");
+    }
+}
+
+/// @brief JSON：所有桶和分片都输出，方便下游按下标对齐
+template <class Out>
+static void FormatJson(const AllocatorStats &stats, Out &out)
+{
+    out.Printf("{\"system\":{\"mapped_bytes\":%zu,\"unmapped_bytes\":%zu,\"released_bytes\":%zu},",
+               stats._mappedBytes, stats._unmappedBytes, stats._releasedBytes);
+    out.Printf("\"thread_caches\":%zu,\"size_classes\":[", stats._threadCaches);
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        const SizeClassStats &cs = stats._classes[i];
+        out.Printf("%s{\"size\":%zu,\"tc_objects\":%zu,\"tc_bytes\":%zu,\"transfer_objects\":%zu,"
+                   "\"spans\":%zu,\"in_use_objects\":%zu,\"free_objects\":%zu,"
+                   "\"lock_acquires\":%zu,\"lock_contended\":%zu}",
+                   i ? "," : "", cs._size, cs._tcObjects, cs._tcBytes, cs._transferObjects,
+                   cs._spans, cs._inUseObjects, cs._freeObjects, cs._lock._acquires, cs._lock._contended);
+    }
+    out.Printf("],\"arenas\":[");
+    for (size_t i = 0; i < ARENA_NUM; ++i)
+    {
+        const ArenaStats &as = stats._arenas[i];
+        out.Printf("%s{\"free_pages\":%zu,\"returned_pages\":%zu,\"lock_acquires\":%zu,\"lock_contended\":%zu,\"free_spans\":{",
+                   i ? "," : "", as._freePages, as._returnedPages, as._lock._acquires, as._lock._contended);
+        bool first = true;
+        for (size_t k = 1; k <= PAGE_NUM; ++k)
+        {
+            if (as._freeSpans[k] == 0)
+                continue;
+            out.Printf("%s\"%zu\":%zu", first ? "" : ",", k, as._freeSpans[k]);
+            first = false;
+        }
+        out.Printf("}}");
+    }
+    out.Printf("]}\n");
+}
+
+size_t FormatAllocatorStats(const AllocatorStats &stats, char *buf, size_t len, bool json)
+{
+    BufferOut out{buf, len};
+    if (json)
+        FormatJson(stats, out);
+    else
+        FormatText(stats, out);
+
+    if (len > 0 && out._need >= len)
+        buf[len - 1] = '\0';
+    return out._need;
+}
+
+void DumpAllocatorStats(int fd, bool json)
+{
+    // 快照有几十KB，放在静态区而不是栈上，信号处理线程的栈可能很小
+    static std::mutex mtx;
+    static AllocatorStats stats;
+    std::lock_guard<std::mutex> lock(mtx);
+
+    stats = AllocatorStats{}; // 原地值初始化，编译器直接清零静态对象，不在栈上放一份快照
+    CollectAllocatorStats(stats);
+    FdOut out{fd};
+    if (json)
+        FormatJson(stats, out);
+    else
+        FormatText(stats, out);
+    out.Flush();
+}
@@ -0,0 +1,47 @@
+#include "../include/ThreadCache.h"
+#include "../include/CentralCache.h"
+#include "../include/PageCache.h"
+#include "../include/HeapProfiler.h"
+#ifdef PER_CPU_CACHE
+#include "../include/CpuCache.h"
+#endif
+
+// fork只复制调用线程，其它线程持有的锁在子进程中永远不会被释放，子进程再申请内存就会死锁
+// 与glibc的malloc相同，fork前按固定顺序持有内存池的所有锁，使复制出的状态一致，父子进程中再全部释放
+// 顺序与正常路径上的嵌套方向一致：tc链表/每CPU槽 → cc各桶和中转缓存 → pc各分片 → 基数树 → 堆采样
+
+static void ForkPrepare()
+{
+    ThreadCache::ForkLock();
+#ifdef PER_CPU_CACHE
+    CpuCache::GetInstance()->ForkLock();
+#endif
+    for (size_t i = 0; i < NUMA_NODE_NUM; ++i)
+        CentralCache::GetNode(i)->ForkLock();
+    for (size_t i = 0; i < ARENA_NUM; ++i)
+        PageCache::GetArena(i)->_pageMtx.lock();
+    PageCache::_idSpanMap.ForkLock();
+    HeapProfiler::ForkLock();
+}
+
+/// @brief 按与ForkPrepare相反的顺序释放，父子进程共用
+/// @details 子进程中持有者换成了新的线程号，std::mutex默认类型的解锁不检查持有者，可以直接释放
+static void ForkRelease()
+{
+    HeapProfiler::ForkUnlock();
+    PageCache::_idSpanMap.ForkUnlock();
+    for (size_t i = ARENA_NUM; i-- > 0;)
+        PageCache::GetArena(i)->_pageMtx.unlock();
+    for (size_t i = NUMA_NODE_NUM; i-- > 0;)
+        CentralCache::GetNode(i)->ForkUnlock();
+#ifdef PER_CPU_CACHE
+    CpuCache::GetInstance()->ForkUnlock();
+#endif
+    ThreadCache::ForkUnlock();
+}
+
+/// @brief 由PageCache.cpp中的构造函数在库加载时调用，这时还没有其它线程持有锁
+void RegisterForkHandlers()
+{
+    pthread_atfork(ForkPrepare, ForkRelease, ForkRelease);
+}
@@ -1,44 +1,43 @@
 #include "../include/CentralCache.h"
 #include "../include/PageCache.h"
+#include "../include/GuardedAlloc.h"
 
-CentralCache CentralCache::_sInst; // CentralCache的饿汉对象
+CONSTINIT CentralCache CentralCache::_sInst[NUMA_NODE_NUM]; // 各节点的饿汉对象
 
-Span *CentralCache::GetOneSpan(SpanList &list, size_t size)
+Span *CentralCache::GetOneSpan(SpanBins &bins, size_t size)
 {
-    // 先在cc中寻找管理空间不为空的Span
-    Span *it = list.begin();
-    while (it != list.end())
-    {
-        if (it->_freeList != nullptr)
-            return it;
-        it = it->next;
-    }
+    // 先在cc中取占用率最高的、还有空闲块（还回来的或尚未切分的）的Span
+    Span *span = bins.Pick();
+    if (span)
+        return span;
 
-    list._mtx.unlock(); // 不需要使用该桶了，解锁
+    bins._mtx.unlock(); // 不需要使用该桶了，解锁
 
     // 到这说明cc中没有管理空间不为空的Span，需要向pc申请
     size_t k = SizeClass::NumMovePage(size); // 申请k页
-    PageCache::GetInstance()->_pageMtx.lock();
-    Span *span = PageCache::GetInstance()->NewSpan(k); // 返回一个 完全没有划分 的Span
+    PageCache *pc = PageCache::GetInstance(); // 当前线程绑定的分片
+    pc->_pageMtx.lock();
+    span = pc->NewSpan(k); // 返回一个 完全没有划分 的Span
     span->_isUse = true;
-    PageCache::GetInstance()->_pageMtx.unlock();
-
-    // 开始切分span，切分成一个一个块，每个块大小为size
-    char *start = (char *)(span->_pageID << PAGE_SHIFT);    // 起始地址
-    char *end = (char *)(start + (span->_n << PAGE_SHIFT)); // 结束地址
-    void *cur = start;
-    start += size;
-    while (start < end)
-    {
-        ObjNext(cur) = start;
-        start += size;
-        cur = ObjNext(cur);
-    }
-    ObjNext(cur) = nullptr;
-
-    list._mtx.lock();
-    // 将切分好的span交给list管理
-    list.push_front(span);
+    span->_objSize = size; // 记录块大小，ConcurrentFree(void*)通过页号找到Span后直接取用
+    pc->_pageMtx.unlock();
+
+#ifdef GUARDED_ALLOC
+    AllocGuard::OnCarve(span);
+#endif
+
+    // 不在这里把整个Span串成链表，只记下切分范围，由FetchRangeObj按需从前往后切
+    // 从未分出去的块不会被写到，对应的页也不会提前产生缺页；块仍位于起始地址+i*size，对齐申请不受影响
+    char *start = (char *)(span->_pageID << PAGE_SHIFT);
+    span->_freeList = nullptr;
+    span->_carve = start;
+    span->_capacity = (span->_n << PAGE_SHIFT) / size;
+    span->_carveEnd = start + span->_capacity * size; // 末尾放不下一整块的零头不切
+    span->_use_count = 0;
+
+    bins._mtx.lock();
+    // 将span交给bins管理，此时占用率为0
+    bins.Insert(span);
 
     return span;
 }
@@ -48,66 +47,204 @@ size_t CentralCache::FetchRangeObj(void *&start, void *&end, size_t batchNum, si
     // 获取到size对应到哪一个SpanList
     size_t index = SizeClass::Index(size);
 
+    // 先看中转缓存中有没有其它tc整批还回来的块，有就直接拿走，不碰桶锁
+    size_t n = _transferCaches[index].Remove(start, end);
+    if (n > 0)
+        return n;
+
     // 由于cc是全局唯一的，因此对桶中自由链表操作时要加锁
-    _spanLists[index]._mtx.lock();
+    SpanBins &bins = _spanBins[index];
+    bins._mtx.lock();
 
-    // 获取一个管理空间不为空的Span
-    Span *span = GetOneSpan(_spanLists[index], size);
+    // 获取一个还有空闲块的Span
+    Span *span = GetOneSpan(bins, size);
     assert(span);
-    assert(span->_freeList);
+    assert(span->_freeList || span->_carve != span->_carveEnd);
+
+#ifdef HARDENED_FREELIST
+    // 解码出的每一块都必须落在这个Span中
+    char *spanStart = (char *)(span->_pageID << PAGE_SHIFT);
+    char *spanEnd = spanStart + (span->_n << PAGE_SHIFT);
+    auto checkLink = [&](void *obj)
+    {
+        if (obj && ((char *)obj < spanStart || (char *)obj >= spanEnd || ((char *)obj - spanStart) % size != 0))
+            FreeListCorrupted(obj);
+    };
+#endif
+
+    // 先取还回来的块，它们已经串在一起，缓存中也更可能是热的
+    size_t actualNum = 0;
+    start = end = nullptr;
+    if (span->_freeList)
+    {
+        start = end = span->_freeList; // 初始化start、end指向第一块
+        actualNum = 1;                 // 已经指向第一块了，实际分配块数从1开始
+        void *next = LoadNext(end);
+        while (actualNum < batchNum && next != nullptr)
+        {
+#ifdef HARDENED_FREELIST
+            checkLink(next);
+#endif
+            end = next;           // 后移end
+            next = LoadNext(end); // end的下一块
+            ++actualNum;          // 实际分配块数+1
+        }
+#ifdef HARDENED_FREELIST
+        checkLink(next);
+#endif
+        span->_freeList = next; // 更新自由链表头节点
+    }
 
-    start = end = span->_freeList; // 初始化start、end指向第一块
-    int i = 1, actualNum = 1;      // 已经指向第一块了，所以end起始位移和实际分配块数都是1
-    while (i < batchNum - 1 && ObjNext(end) != nullptr)
+    // 不够时从尚未切分的部分顺序切出，只写到分出去的块
+    while (actualNum < batchNum && span->_carve != span->_carveEnd)
     {
-        end = ObjNext(end); // 后移end
-        ++i;                // end位移+1
-        ++actualNum;        // 实际分配块数+1
+        void *obj = span->_carve;
+        span->_carve += size;
+        if (actualNum == 0)
+            start = obj;
+        else
+            StoreNext(end, obj);
+        end = obj;
+        ++actualNum;
     }
-    span->_freeList = ObjNext(end); // 更新自由链表头节点
+
     span->_use_count += actualNum;
-    ObjNext(end) = nullptr; // 将分配的块和原先的自由链表断开
+    StoreNext(end, nullptr); // 将分配的块和原先的自由链表断开
+    bins.Update(span);       // 占用率升高，可能移到更高的组
 
-    _spanLists[index]._mtx.unlock();
+    bins._mtx.unlock();
 
     return actualNum;
 }
 
 void CentralCache::ReleaseListToSpans(void *start, size_t size)
-{ // 不需要传整体的大小，因为通过ObjNext从start开始遍历，最终会为nullptr
+{ // 不需要传整体的大小，因为通过LoadNext从start开始遍历，最终会为nullptr
     // 通过size找到桶下标
     size_t index = SizeClass::Index(size);
 
-    _spanLists[index]._mtx.lock();
+    // 块可能来自不同节点的Span，锁住的总是当前块所属实例的桶，相邻的块通常属于同一个实例
+    SpanBins *locked = nullptr;
 
     // 遍历start，将各个块放到对应的Span所管理的_freeList中
     while (start)
     {
-        void *next = ObjNext(start);                                   // 记录start的下一块
-        Span *span = PageCache::GetInstance()->MapObjectToSpan(start); // 获取管理start的对应Span
+        void *next = LoadNext(start);                   // 记录start的下一块
+        Span *span = PageCache::MapObjectToSpan(start); // 获取管理start的对应Span
+#ifdef HARDENED_FREELIST
+        // 链表来自tc，start可能是被改写的链接解码出来的
+        if (span == nullptr || span->_isLarge || SizeClass::Index(span->_objSize) != index)
+            FreeListCorrupted(start);
+#endif
+        SpanBins &bins = GetInstance(span)->_spanBins[index];
+        if (&bins != locked)
+        {
+            if (locked)
+                locked->_mtx.unlock();
+            bins._mtx.lock();
+            locked = &bins;
+        }
+
         // 回收到自由链表中
-        ObjNext(start) = span->_freeList;
+        StoreNext(start, span->_freeList);
         span->_freeList = start;
 
         --span->_use_count; // 减少已分配块数量
         if (span->_use_count == 0)
-        { // cc当前管理的这个span所有页都归还回来了，可以考虑归还给pc了
+        { // cc当前管理的这个span所有块都归还回来了，立即还给pc
             // 先将span从cc中删去
-            _spanLists[index].erase(span);
+            bins.Erase(span);
             span->_freeList = nullptr;
-            span->prev = nullptr;
-            span->next = nullptr;
+            span->_carve = span->_carveEnd = nullptr;
 
-            _spanLists[index]._mtx.unlock();
+            bins._mtx.unlock();
+            locked = nullptr;
 
-            PageCache::GetInstance()->_pageMtx.lock();
-            PageCache::GetInstance()->ReleaseSpanToPageCache(span);
-            PageCache::GetInstance()->_pageMtx.unlock();
+#ifdef GUARDED_ALLOC
+            AllocGuard::OnRelease(span);
+#endif
 
-            _spanLists[index]._mtx.lock();
+            PageCache *pc = PageCache::GetInstance(span); // 还给span所属的分片
+            pc->_pageMtx.lock();
+            pc->ReleaseSpanToPageCache(span);
+            pc->_pageMtx.unlock();
+        }
+        else
+        {
+            bins.Update(span); // 占用率降低，可能移到更低的组
         }
         start = next; // 跳到下一块
     }
 
-    _spanLists[index]._mtx.unlock();
-}
\ No newline at end of file
+    if (locked)
+        locked->_mtx.unlock();
+}
+
+void CentralCache::ReleaseRangeObj(void *start, void *end, size_t n, size_t size)
+{
+    size_t index = SizeClass::Index(size);
+
+    // 多节点时放进第一块所属节点的中转缓存，供那个节点的线程取用，一批块通常来自同一个节点
+    CentralCache *owner = this;
+    if (Numa::NodeCount() > 1)
+        owner = GetInstance(PageCache::MapObjectToSpan(start));
+
+    // 整批放进中转缓存，O(1)完成，不需要逐块查页号
+    if (owner->_transferCaches[index].Insert(start, end, n, size))
+        return;
+
+    ReleaseListToSpans(start, size);
+}
+
+void CentralCache::FlushTransferCaches()
+{
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        void *start = nullptr;
+        void *end = nullptr;
+        while (_transferCaches[i].Remove(start, end) > 0)
+        {
+            size_t size = PageCache::MapObjectToSpan(start)->_objSize;
+            ReleaseListToSpans(start, size);
+        }
+    }
+}
+
+void CentralCache::CollectStats(AllocatorStats &stats)
+{
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        SizeClassStats &cs = stats._classes[i];
+        cs._transferObjects += _transferCaches[i].Objects();
+
+        SpanBins &bins = _spanBins[i];
+        bins._mtx.lock();
+        bins.ForEach([&](Span *span)
+        {
+            // 按容量减去已分出的块数计算剩余块数，不遍历Span的自由链表
+            ++cs._spans;
+            cs._inUseObjects += span->_use_count;
+            cs._freeObjects += span->_capacity - span->_use_count;
+        });
+        cs._lock._acquires += bins._mtx.Acquires();
+        cs._lock._contended += bins._mtx.Contended();
+        bins._mtx.unlock();
+    }
+}
+
+void CentralCache::ForkLock()
+{
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        _spanBins[i]._mtx.lock();
+        _transferCaches[i].lock();
+    }
+}
+
+void CentralCache::ForkUnlock()
+{
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        _transferCaches[i].unlock();
+        _spanBins[i]._mtx.unlock();
+    }
+}
@@ -0,0 +1,545 @@
+#include "../include/CpuCache.h"
+#include <cstring>
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef CPU_CACHE_RSEQ
+#include <linux/membarrier.h>
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#endif
+
+CONSTINIT CpuCache CpuCache::_sInst; // CpuCache的饿汉对象
+
+#ifdef CPU_CACHE_RSEQ
+// rseq临界区的返回值
+static const int RSEQ_OK = 0;      // 完成
+static const int RSEQ_FAIL = 1;    // 数组为空（弹出）或已满（压入）
+static const int RSEQ_ABORT = 2;   // 被内核中止或已不在该CPU上，重新读取CPU编号后重来
+static const int RSEQ_STOPPED = 3; // 槽正在被Drain，等它放开槽锁后重来
+
+/// @brief 当前线程由glibc注册的rseq区域
+static inline struct rseq *RseqArea()
+{
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/// @brief 当前线程所在的CPU，未注册或注册失败时为负数
+static inline int RseqCpu(struct rseq *rs)
+{
+    return (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+}
+
+// 临界区的描述符放在__rseq_cs节中，起点1、提交后2、中止入口4；中止入口前4字节必须是注册时的RSEQ_SIG
+// 临界区内先确认仍在cpu上、槽没有停用，最后一条指令写回块数作为提交
+
+/// @brief 在cpu上从arr弹出一块，*count是arr中的块数
+static inline int RseqPopOn(struct rseq *rs, int cpu, size_t *stopped, size_t *count, void **arr, void *&obj)
+{
+    int ret;
+#if defined(__x86_64__)
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "cmpq $0, %[stopped]\n\t"
+        "jnz 6f\n\t"
+        "movq %[count], %%rax\n\t"
+        "testq %%rax, %%rax\n\t"
+        "jz 5f\n\t"
+        "movq -8(%[arr], %%rax, 8), %[obj]\n\t"
+        "decq %%rax\n\t"
+        "movq %%rax, %[count]\n\t"
+        "2:\n\t"
+        "movl $0, %[ret]\n\t"
+        "jmp 7f\n\t"
+        "5:\n\t"
+        "movl $1, %[ret]\n\t"
+        "jmp 7f\n\t"
+        "6:\n\t"
+        "movl $3, %[ret]\n\t"
+        "jmp 7f\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t" // 与后面的签名组成一条ud1指令
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "movl $2, %[ret]\n\t"
+        "7:\n\t"
+        : [ret] "=&r"(ret), [obj] "=&r"(obj), [count] "+m"(*count), [rseq_cs] "=m"(rs->rseq_cs)
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [stopped] "m"(*stopped), [arr] "r"(arr), [sig] "i"(RSEQ_SIG)
+        : "rax", "memory", "cc");
+#elif defined(__aarch64__)
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "adrp x15, 3b\n\t"
+        "add x15, x15, :lo12:3b\n\t"
+        "str x15, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "ldr w15, %[cpu_id]\n\t"
+        "cmp w15, %w[cpu]\n\t"
+        "b.ne 4f\n\t"
+        "ldr x15, %[stopped]\n\t"
+        "cbnz x15, 6f\n\t"
+        "ldr x15, %[count]\n\t"
+        "cbz x15, 5f\n\t"
+        "sub x15, x15, #1\n\t"
+        "ldr %[obj], [%[arr], x15, lsl #3]\n\t"
+        "str x15, %[count]\n\t"
+        "2:\n\t"
+        "mov %w[ret], #0\n\t"
+        "b 7f\n\t"
+        "5:\n\t"
+        "mov %w[ret], #1\n\t"
+        "b 7f\n\t"
+        "6:\n\t"
+        "mov %w[ret], #3\n\t"
+        "b 7f\n\t"
+        ".inst %c[sig]\n\t"
+        "4:\n\t"
+        "mov %w[ret], #2\n\t"
+        "7:\n\t"
+        : [ret] "=&r"(ret), [obj] "=&r"(obj), [count] "+Q"(*count), [rseq_cs] "=Q"(rs->rseq_cs)
+        : [cpu] "r"(cpu), [cpu_id] "Q"(rs->cpu_id), [stopped] "Q"(*stopped), [arr] "r"(arr), [sig] "i"(RSEQ_SIG_CODE)
+        : "x15", "memory", "cc");
+#endif
+    return ret;
+}
+
+/// @brief 在cpu上把obj压入容量为cap的arr，*count是arr中的块数
+/// @details 先写数组再提交块数，中途被中止时写到数组中的指针不在块数范围内，相当于没写
+static inline int RseqPushOn(struct rseq *rs, int cpu, size_t *stopped, size_t *count, void **arr, size_t cap, void *obj)
+{
+    int ret;
+#if defined(__x86_64__)
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "cmpq $0, %[stopped]\n\t"
+        "jnz 6f\n\t"
+        "movq %[count], %%rax\n\t"
+        "cmpq %[cap], %%rax\n\t"
+        "jae 5f\n\t"
+        "movq %[obj], (%[arr], %%rax, 8)\n\t"
+        "incq %%rax\n\t"
+        "movq %%rax, %[count]\n\t"
+        "2:\n\t"
+        "movl $0, %[ret]\n\t"
+        "jmp 7f\n\t"
+        "5:\n\t"
+        "movl $1, %[ret]\n\t"
+        "jmp 7f\n\t"
+        "6:\n\t"
+        "movl $3, %[ret]\n\t"
+        "jmp 7f\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "movl $2, %[ret]\n\t"
+        "7:\n\t"
+        : [ret] "=&r"(ret), [count] "+m"(*count), [rseq_cs] "=m"(rs->rseq_cs)
+        : [cpu] "r"(cpu), [cpu_id] "m"(rs->cpu_id), [stopped] "m"(*stopped), [arr] "r"(arr), [cap] "r"(cap),
+          [obj] "r"(obj), [sig] "i"(RSEQ_SIG)
+        : "rax", "memory", "cc");
+#elif defined(__aarch64__)
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "adrp x15, 3b\n\t"
+        "add x15, x15, :lo12:3b\n\t"
+        "str x15, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "ldr w15, %[cpu_id]\n\t"
+        "cmp w15, %w[cpu]\n\t"
+        "b.ne 4f\n\t"
+        "ldr x15, %[stopped]\n\t"
+        "cbnz x15, 6f\n\t"
+        "ldr x15, %[count]\n\t"
+        "cmp x15, %[cap]\n\t"
+        "b.hs 5f\n\t"
+        "str %[obj], [%[arr], x15, lsl #3]\n\t"
+        "add x15, x15, #1\n\t"
+        "str x15, %[count]\n\t"
+        "2:\n\t"
+        "mov %w[ret], #0\n\t"
+        "b 7f\n\t"
+        "5:\n\t"
+        "mov %w[ret], #1\n\t"
+        "b 7f\n\t"
+        "6:\n\t"
+        "mov %w[ret], #3\n\t"
+        "b 7f\n\t"
+        ".inst %c[sig]\n\t"
+        "4:\n\t"
+        "mov %w[ret], #2\n\t"
+        "7:\n\t"
+        : [ret] "=&r"(ret), [count] "+Q"(*count), [rseq_cs] "=Q"(rs->rseq_cs)
+        : [cpu] "r"(cpu), [cpu_id] "Q"(rs->cpu_id), [stopped] "Q"(*stopped), [arr] "r"(arr), [cap] "r"(cap),
+          [obj] "r"(obj), [sig] "i"(RSEQ_SIG_CODE)
+        : "x15", "memory", "cc");
+#endif
+    return ret;
+}
+
+/// @brief 打断本进程所有线程正在执行的rseq临界区，返回后它们重来时能看到此前的写入
+static bool RseqFence()
+{
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+}
+
+/// @brief 当前线程的rseq可用、能注册加速的membarrier，并且没有通过环境变量关闭
+static bool RseqUsable(size_t slotNum)
+{
+    const char *env = getenv("CONCURRENT_ALLOC_RSEQ");
+    if (env && strcmp(env, "0") == 0)
+        return false;
+    if (__rseq_size == 0) // glibc没有注册，例如设置了glibc.pthread.rseq=0
+        return false;
+    int cpu = RseqCpu(RseqArea());
+    if (cpu < 0 || (size_t)cpu >= slotNum)
+        return false;
+    return syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+}
+#endif
+
+void CpuCache::InitSlotsOnce()
+{
+    pthread_once(&_initOnce, []()
+    {
+        CpuCache &cc = _sInst;
+        long n = sysconf(_SC_NPROCESSORS_CONF);
+        cc._slotNum = n > 0 ? (size_t)n : 1;
+
+        // 槽直接从系统页中申请，不经过malloc
+        size_t bytes = cc._slotNum * sizeof(Slot);
+        size_t k = (bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        cc._slots = (Slot *)SystemAlloc(k);
+        for (size_t i = 0; i < cc._slotNum; ++i)
+        {
+            new (&cc._slots[i]) Slot;
+        }
+
+#ifdef CPU_CACHE_RSEQ
+        cc._rseq = RseqUsable(cc._slotNum);
+        if (cc._rseq)
+        { // 每桶最多缓存一批或CPU_CACHE_CLASS_BYTES字节，至少一块；数组按页申请，用到时才占物理内存
+            size_t total = 0;
+            for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+            {
+                size_t size = SizeClass::ClassSize(i);
+                size_t cap = std::min(SizeClass::NumMoveSize(size), std::max<size_t>(1, CPU_CACHE_CLASS_BYTES / size));
+                cc._caps[i] = (uint32_t)cap;
+                cc._offsets[i] = (uint32_t)total;
+                total += cap;
+            }
+            size_t arrPages = (total * sizeof(void *) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+            for (size_t i = 0; i < cc._slotNum; ++i)
+            {
+                cc._slots[i]._objs = (void **)SystemAlloc(arrPages);
+            }
+        }
+#endif
+        cc._ready.store(true, std::memory_order_release);
+    });
+}
+
+CpuCache::Slot &CpuCache::CurrentSlot()
+{
+    InitSlots();
+
+    // glibc 2.35起会为每个线程注册rseq，sched_getcpu直接读取rseq区域中的cpu_id，不需要系统调用
+    int cpu = sched_getcpu();
+    if (cpu < 0)
+    { // 拿不到CPU编号时退化为按线程分片：线程首次进入时轮流分配一个槽
+        static std::atomic<size_t> next{0};
+        static __thread size_t shard = (size_t)-1;
+        if (shard == (size_t)-1)
+            shard = next.fetch_add(1, std::memory_order_relaxed);
+        cpu = (int)(shard % _slotNum);
+    }
+    return _slots[(size_t)cpu % _slotNum];
+}
+
+#ifdef CPU_CACHE_RSEQ
+/// @brief 当前线程能否走rseq路径：glibc为它注册成功并且CPU编号在槽的范围内
+static inline bool RseqThreadReady(size_t slotNum)
+{
+    return (unsigned)RseqCpu(RseqArea()) < slotNum;
+}
+
+inline bool CpuCache::RseqPop(size_t index, void *&obj)
+{
+    struct rseq *rs = RseqArea();
+    while (true)
+    {
+        int cpu = RseqCpu(rs);
+        if ((unsigned)cpu >= _slotNum)
+            return false;
+        Slot &slot = _slots[cpu];
+        int ret = RseqPopOn(rs, cpu, &slot._stopped, &slot._counts[index], slot._objs + _offsets[index], obj);
+        if (ret == RSEQ_OK)
+            return true;
+        if (ret == RSEQ_FAIL)
+            return false;
+        if (ret == RSEQ_STOPPED)
+            std::lock_guard<std::mutex> lock(slot._mtx); // 等Drain结束
+    }
+}
+
+inline bool CpuCache::RseqPush(size_t index, void *obj)
+{
+    struct rseq *rs = RseqArea();
+    while (true)
+    {
+        int cpu = RseqCpu(rs);
+        if ((unsigned)cpu >= _slotNum)
+            return false;
+        Slot &slot = _slots[cpu];
+        int ret = RseqPushOn(rs, cpu, &slot._stopped, &slot._counts[index], slot._objs + _offsets[index],
+                             _caps[index], obj);
+        if (ret == RSEQ_OK)
+            return true;
+        if (ret == RSEQ_FAIL)
+            return false;
+        if (ret == RSEQ_STOPPED)
+            std::lock_guard<std::mutex> lock(slot._mtx);
+    }
+}
+
+/// @brief 数组为空时从cc取约半个数组的块，第一块返回给调用者
+/// @details 逐块压入期间可能已被迁移到其它CPU，压到哪个CPU的数组都可以；压不下的部分整段还给cc
+void *CpuCache::RseqRefill(size_t index)
+{
+    size_t alignSize = SizeClass::ClassSize(index);
+    size_t batchNum = (_caps[index] + 1) / 2;
+
+    void *start = nullptr;
+    void *end = nullptr;
+    size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, alignSize);
+    assert(actualNum >= 1);
+
+    void *obj = actualNum > 1 ? LoadNext(start) : nullptr;
+    for (size_t i = 1; i < actualNum; ++i)
+    {
+        void *next = i + 1 < actualNum ? LoadNext(obj) : nullptr; // 压入后块可能马上被其它线程取走改写，先读出下一块
+        if (!RseqPush(index, obj))
+        { // obj还没压入，从obj到end仍是完整的链表
+            CentralCache::GetInstance()->ReleaseRangeObj(obj, end, actualNum - i, alignSize);
+            break;
+        }
+        obj = next;
+    }
+    return start;
+}
+
+/// @brief 数组已满时弹出约半个数组，和obj串成一条链表还给cc
+void CpuCache::RseqOverflow(size_t index, void *obj)
+{
+    size_t batchNum = (_caps[index] + 1) / 2;
+
+    void *end = obj;
+    size_t n = 1;
+    void *next = nullptr;
+    while (n <= batchNum && RseqPop(index, next))
+    {
+        StoreNext(end, next);
+        end = next;
+        ++n;
+    }
+    StoreNext(end, nullptr);
+    CentralCache::GetInstance()->ReleaseRangeObj(obj, end, n, SizeClass::ClassSize(index));
+}
+
+/// @brief 把slot各数组中的块还给cc
+/// @details 调用者持有slot._mtx、已设置_stopped并调用过RseqFence，此后不会再有临界区修改这个槽
+void CpuCache::RseqDrainSlot(Slot &slot)
+{
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        size_t n = slot._counts[i];
+        if (n == 0)
+            continue;
+
+        void **arr = slot._objs + _offsets[i];
+        for (size_t j = 0; j + 1 < n; ++j)
+        {
+            StoreNext(arr[j], arr[j + 1]);
+        }
+        StoreNext(arr[n - 1], nullptr);
+        CentralCache::GetInstance()->ReleaseRangeObj(arr[0], arr[n - 1], n, SizeClass::ClassSize(i));
+        slot._counts[i] = 0;
+    }
+}
+#endif
+
+void *CpuCache::Allocate(size_t size)
+{
+    InitSlots();
+#ifdef CPU_CACHE_RSEQ
+    if (_rseq && RseqThreadReady(_slotNum))
+    {
+        size_t index = SizeClass::Index(size);
+        void *obj = nullptr;
+        if (RseqPop(index, obj))
+            return obj;
+        return RseqRefill(index);
+    }
+#endif
+
+    Slot &slot = CurrentSlot();
+    std::lock_guard<std::mutex> lock(slot._mtx);
+    return slot._cache.Allocate(size);
+}
+
+void CpuCache::Deallocate(void *obj, size_t size)
+{
+    InitSlots();
+#ifdef CPU_CACHE_RSEQ
+    if (_rseq && RseqThreadReady(_slotNum))
+    {
+        size_t index = SizeClass::Index(size);
+        if (!RseqPush(index, obj))
+            RseqOverflow(index, obj);
+        return;
+    }
+#endif
+
+    Slot &slot = CurrentSlot();
+    std::lock_guard<std::mutex> lock(slot._mtx);
+    slot._cache.Deallocate(obj, size);
+}
+
+void CpuCache::AllocateBatch(size_t size, void **objs, size_t n)
+{
+    InitSlots();
+#ifdef CPU_CACHE_RSEQ
+    if (_rseq && RseqThreadReady(_slotNum))
+    { // 每块各走一次临界区，一次只占用CPU很短的时间
+        for (size_t i = 0; i < n; ++i)
+            objs[i] = Allocate(size);
+        return;
+    }
+#endif
+
+    Slot &slot = CurrentSlot();
+    std::lock_guard<std::mutex> lock(slot._mtx);
+    slot._cache.AllocateBatch(size, objs, n);
+}
+
+void CpuCache::DeallocateBatch(void **objs, size_t n, size_t size)
+{
+    InitSlots();
+#ifdef CPU_CACHE_RSEQ
+    if (_rseq && RseqThreadReady(_slotNum))
+    {
+        for (size_t i = 0; i < n; ++i)
+            Deallocate(objs[i], size);
+        return;
+    }
+#endif
+
+    Slot &slot = CurrentSlot();
+    std::lock_guard<std::mutex> lock(slot._mtx);
+    slot._cache.DeallocateBatch(objs, n, size);
+}
+
+void CpuCache::Drain()
+{
+    InitSlots();
+
+#ifdef CPU_CACHE_RSEQ
+    if (_rseq)
+    { // 先停用所有槽，再一次打断各CPU上进行中的临界区；拿到槽锁的顺序固定，不会和其它Drain死锁
+        for (size_t i = 0; i < _slotNum; ++i)
+        {
+            _slots[i]._mtx.lock();
+            __atomic_store_n(&_slots[i]._stopped, 1, __ATOMIC_RELAXED);
+        }
+
+        bool fenced = RseqFence(); // 注册成功后不会失败；万一失败，数组里的块留在原处，只清空加锁路径的缓存
+        for (size_t i = 0; i < _slotNum; ++i)
+        {
+            if (fenced)
+                RseqDrainSlot(_slots[i]);
+            _slots[i]._cache.Drain();
+        }
+
+        for (size_t i = 0; i < _slotNum; ++i)
+        {
+            __atomic_store_n(&_slots[i]._stopped, 0, __ATOMIC_RELEASE);
+            _slots[i]._mtx.unlock();
+        }
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < _slotNum; ++i)
+    {
+        std::lock_guard<std::mutex> lock(_slots[i]._mtx);
+        _slots[i]._cache.Drain();
+    }
+}
+
+/// @brief rseq路径的块数由各CPU随时修改，这里按relaxed读取，得到的是近似值
+void CpuCache::CollectStats(AllocatorStats &stats)
+{
+    InitSlots();
+
+    for (size_t i = 0; i < _slotNum; ++i)
+    {
+        std::lock_guard<std::mutex> lock(_slots[i]._mtx);
+        _slots[i]._cache.CollectStats(stats);
+#ifdef CPU_CACHE_RSEQ
+        if (_rseq)
+        {
+            for (size_t j = 0; j < FREE_LIST_NUM; ++j)
+            {
+                size_t n = __atomic_load_n(&_slots[i]._counts[j], __ATOMIC_RELAXED);
+                stats._classes[j]._tcObjects += n;
+                stats._classes[j]._tcBytes += n * stats._classes[j]._size;
+            }
+        }
+#endif
+    }
+}
+
+// 槽还没创建时没有锁可拿；rseq路径不加锁，fork只复制调用线程，其它线程的临界区不会在子进程中继续
+void CpuCache::ForkLock()
+{
+    if (!_ready.load(std::memory_order_acquire))
+        return;
+    for (size_t i = 0; i < _slotNum; ++i)
+        _slots[i]._mtx.lock();
+}
+
+void CpuCache::ForkUnlock()
+{
+    if (!_ready.load(std::memory_order_acquire))
+        return;
+    for (size_t i = 0; i < _slotNum; ++i)
+        _slots[i]._mtx.unlock();
+}
@@ -0,0 +1,183 @@
+#include "../include/HeapProfiler.h"
+#include "../include/PageCache.h"
+#include "../include/AllocatorStats.h"
+#include <cmath>
+#include <execinfo.h>
+#include <cstring>
+#include <fcntl.h>
+
+__thread ptrdiff_t HeapProfiler::_tBytesUntilSample = 0; // 第一次申请就进入慢路径抽取倒计时
+__thread bool HeapProfiler::_tInSample = false;
+__thread uint64_t HeapProfiler::_tRand = 0;
+
+CONSTINIT std::atomic<size_t> HeapProfiler::_sampleRate{0};
+CONSTINIT std::atomic<bool> HeapProfiler::_active{false};
+CONSTINIT std::mutex HeapProfiler::_mtx;
+HeapProfiler::Bucket *HeapProfiler::_table[BUCKET_NUM] = {};
+CONSTINIT ObjectPool<HeapProfiler::Bucket> HeapProfiler::_bucketPool;
+CONSTINIT ObjectPool<HeapProfiler::Sample> HeapProfiler::_samplePool;
+
+/// @brief 抽取下一次采样前还需申请的字节数，服从均值为采样间隔的指数分布
+/// @details 固定间隔会和程序自身的申请周期产生共振，指数分布保证每个字节被采样的概率相同
+void HeapProfiler::PickNextSample()
+{
+    size_t rate = SampleRate();
+    if (rate == 0)
+    { // 采样关闭，隔一段再检查开关
+        _tBytesUntilSample = RECHECK_BYTES;
+        return;
+    }
+
+    if (_tRand == 0)
+        _tRand = (uint64_t)&_tRand * 2654435761u + 88172645463325252ull; // 按线程的TLS地址播种
+    _tRand ^= _tRand << 13;
+    _tRand ^= _tRand >> 7;
+    _tRand ^= _tRand << 17;
+
+    double u = ((_tRand >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+    double next = -std::log(u) * (double)rate;
+    const double limit = (double)((size_t)1 << 40); // 防止u极小时溢出
+    _tBytesUntilSample = (ptrdiff_t)(next < limit ? next : limit) + 1;
+}
+
+HeapProfiler::Bucket *HeapProfiler::FindBucket(void **stack, size_t depth)
+{
+    size_t hash = depth;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        hash += (size_t)stack[i];
+        hash += hash << 10;
+        hash ^= hash >> 6;
+    }
+
+    Bucket *&head = _table[hash % BUCKET_NUM];
+    for (Bucket *b = head; b; b = b->_next)
+    {
+        if (b->_hash == hash && b->_depth == depth && memcmp(b->_stack, stack, depth * sizeof(void *)) == 0)
+            return b;
+    }
+
+    Bucket *b = _bucketPool.New();
+    b->_hash = hash;
+    b->_depth = depth;
+    memcpy(b->_stack, stack, depth * sizeof(void *));
+    b->_next = head;
+    head = b;
+    return b;
+}
+
+void *HeapProfiler::SampleAlloc(size_t size)
+{
+    if (_tInSample)
+        return nullptr; // backtrace内部申请（首次加载libgcc_s）又走到这里
+
+    bool enabled = SampleRate() != 0;
+    PickNextSample();
+    if (!enabled)
+        return nullptr;
+
+    _tInSample = true;
+    void *stack[MAX_DEPTH + 1];
+    int depth = backtrace(stack, MAX_DEPTH + 1); // 在加锁之前获取，backtrace可能申请内存
+    _tInSample = false;
+
+    // 被采样的块单独占用若干页，释放时才能通过Span找到采样记录
+    size_t kpage = (size + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+    if (kpage == 0)
+        kpage = 1;
+    PageCache *pc = PageCache::GetInstance();
+    pc->_pageMtx.lock();
+    Span *span = pc->NewSpan(kpage);
+    span->_isUse = true;
+    span->_isLarge = true;
+    span->_objSize = kpage << PAGE_SHIFT;
+    pc->_pageMtx.unlock();
+
+    _mtx.lock();
+    Bucket *bucket = FindBucket(stack + 1, depth > 1 ? depth - 1 : 0); // 跳过SampleAlloc自身
+    bucket->_allocCount += 1;
+    bucket->_allocBytes += size;
+    bucket->_liveCount += 1;
+    bucket->_liveBytes += size;
+    Sample *sample = _samplePool.New();
+    sample->_bucket = bucket;
+    sample->_size = size;
+    _mtx.unlock();
+
+    span->_sample = sample; // 块还没交给用户，不会有并发的释放
+    return (void *)(span->_pageID << PAGE_SHIFT);
+}
+
+void HeapProfiler::RecordFree(Span *span)
+{
+    Sample *sample = (Sample *)span->_sample;
+    span->_sample = nullptr;
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    sample->_bucket->_liveCount -= 1;
+    sample->_bucket->_liveBytes -= sample->_size;
+    _samplePool.Delete(sample);
+}
+
+void HeapProfiler::SetSampleRate(size_t bytes)
+{
+    if (bytes)
+    {
+        // backtrace第一次调用时才加载展开库，提前在这里触发，避免在申请路径上加载
+        void *dummy[1];
+        _tInSample = true;
+        backtrace(dummy, 1);
+        _tInSample = false;
+        _active.store(true, std::memory_order_relaxed);
+    }
+
+    _sampleRate.store(bytes, std::memory_order_relaxed);
+    PickNextSample(); // 调用线程立即生效，其它线程在各自当前的倒计时结束后生效
+}
+
+void HeapProfiler::Dump(int fd)
+{
+    FdOut out{fd};
+
+    _mtx.lock();
+    size_t liveCount = 0, liveBytes = 0, allocCount = 0, allocBytes = 0;
+    for (size_t i = 0; i < BUCKET_NUM; ++i)
+    {
+        for (Bucket *b = _table[i]; b; b = b->_next)
+        {
+            liveCount += b->_liveCount;
+            liveBytes += b->_liveBytes;
+            allocCount += b->_allocCount;
+            allocBytes += b->_allocBytes;
+        }
+    }
+
+    // 与gperftools的堆文件格式相同，pprof按heap_v2后的采样间隔还原实际的数量和字节数
+    out.Printf("heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+               liveCount, liveBytes, allocCount, allocBytes, SampleRate());
+    for (size_t i = 0; i < BUCKET_NUM; ++i)
+    {
+        for (Bucket *b = _table[i]; b; b = b->_next)
+        {
+            out.Printf("%zu: %zu [%zu: %zu] @", b->_liveCount, b->_liveBytes, b->_allocCount, b->_allocBytes);
+            for (size_t k = 0; k < b->_depth; ++k)
+                out.Printf(" %p", b->_stack[k]);
+            out.Printf("\n");
+        }
+    }
+    _mtx.unlock();
+
+    // pprof根据映射表把地址符号化
+    out.Printf("\nMAPPED_LIBRARIES:\n");
+    out.Flush();
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps < 0)
+        return;
+    ssize_t n;
+    while ((n = read(maps, out._buf, sizeof(out._buf))) > 0)
+    {
+        out._used = n;
+        out.Flush();
+    }
+    close(maps);
+}
@@ -0,0 +1,401 @@
+#include "../include/ConcurrentAlloc.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <malloc.h>
+#include <new>
+#include <sys/file.h>
+
+// 用内存池替换malloc/free和全局operator new/delete，编译为libConcurrentMalloc.so后可以通过LD_PRELOAD加载
+// 只导出标准分配接口，内存池的其它符号都是隐藏的，不会与程序自身链接的内存池互相干扰
+// 注意事项：
+// 1. 所有单例都在编译期完成初始化，动态初始化之前的malloc调用（例如动态链接器、libstdc++的启动过程）也能直接使用
+// 2. tc在挂上线程退出钩子之前就已经设置到TLS中，pthread_setspecific内部的calloc会重入并复用同一个tc
+// 3. 本编译单元关闭了内建函数优化，否则编译器可能把calloc中的malloc+memset合并成对calloc自身的调用
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+static const size_t MIN_ALIGN = 16;                       // malloc需要满足alignof(max_align_t)
+static const size_t MAX_ALLOC = (size_t)1 << 47;          // 超过用户态地址空间的请求直接失败
+static const size_t PAGE_BYTES = (size_t)1 << PAGE_SHIFT; // valloc/pvalloc的对齐
+
+/// @brief 将申请大小按align向上取整
+/// @details 尺寸类是大小的整数倍，Span又按页对齐，因此MIN_ALIGN整数倍的大小切出的块天然按MIN_ALIGN对齐
+static inline size_t AlignSize(size_t size, size_t align)
+{
+    if (size == 0)
+        size = 1; // malloc(0)也要返回一个可以释放的唯一指针
+    return (size + align - 1) & ~(align - 1);
+}
+
+/// @brief 申请失败时返回nullptr并设置errno，不向C代码抛出异常
+static inline void *ShimAlloc(size_t size)
+{
+    if (size > MAX_ALLOC)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    try
+    {
+        return ConcurrentAlloc(AlignSize(size, MIN_ALIGN));
+    }
+    catch (const std::bad_alloc &)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+/// @brief 对齐申请，align必须是2的幂
+static inline void *ShimAllocAligned(size_t align, size_t size)
+{
+    if (align <= MIN_ALIGN)
+        return ShimAlloc(size);
+    if (size > MAX_ALLOC)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    try
+    {
+        return ConcurrentAllocAligned(size, align);
+    }
+    catch (const std::bad_alloc &)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+/// @brief 查找ptr所属的Span，不是内存池分配的指针返回nullptr
+static inline Span *OwnerSpan(void *ptr)
+{
+    return PageCache::_idSpanMap.get((PageID)ptr >> PAGE_SHIFT);
+}
+
+static inline void ShimFree(void *ptr)
+{
+    if (ptr == nullptr)
+        return;
+
+    Span *span = OwnerSpan(ptr);
+    if (span == nullptr)
+        return; // 不是内存池分配的（例如替换生效前由动态链接器分配），只能忽略
+
+    if (span->_isLarge)
+    {
+        AllocTrace::Record(TRACE_FREE, ptr, 0);
+        ReleaseLargeSpan(span);
+    }
+    else
+        ConcurrentFree(ptr, span->_objSize);
+}
+
+/// @brief 已知大小的释放（sized delete），省去一次基数树查找
+static inline void ShimFreeSized(void *ptr, size_t size)
+{
+    if (ptr == nullptr)
+        return;
+    ConcurrentFree(ptr, AlignSize(size, MIN_ALIGN));
+}
+
+/// @brief operator new的失败处理：反复调用new_handler，没有时抛出bad_alloc
+static inline void *NewImpl(size_t size, size_t align = MIN_ALIGN)
+{
+    while (true)
+    {
+        void *ptr = ShimAllocAligned(align, size);
+        if (ptr)
+            return ptr;
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+static inline void *NewNothrowImpl(size_t size, size_t align = MIN_ALIGN) noexcept
+{
+    try
+    {
+        return NewImpl(size, align);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+#ifdef ALLOC_TRACE
+// 追踪版本：设置环境变量CONCURRENT_ALLOC_TRACE=文件路径时，从库加载起记录所有申请和释放，进程正常退出时写完
+// 路径中的%p替换为进程号；子进程exec后会再次加载本库，同一个文件已被其它进程加锁写入时不再追踪，
+// 否则截断正在映射写入的文件会使那个进程收到SIGBUS
+static int sTraceFd = -1;
+
+__attribute__((constructor)) static void TraceFromEnv()
+{
+    const char *env = getenv("CONCURRENT_ALLOC_TRACE");
+    if (env == nullptr || *env == '\0')
+        return;
+
+    char path[4096];
+    size_t len = 0;
+    for (const char *p = env; *p && len + 24 < sizeof(path); ++p)
+    {
+        if (p[0] == '%' && p[1] == 'p')
+        {
+            len += snprintf(path + len, sizeof(path) - len, "%d", (int)getpid());
+            ++p;
+        }
+        else
+        {
+            path[len++] = *p;
+        }
+    }
+    path[len] = '\0';
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, 0) != 0 || !StartAllocTrace(fd))
+    {
+        close(fd);
+        return;
+    }
+    sTraceFd = fd;
+}
+
+__attribute__((destructor)) static void TraceAtExit()
+{
+    if (sTraceFd < 0)
+        return;
+    if (StopAllocTrace() == AllocTrace::STOP_FAILED)
+    { // 进程正在退出，直接写stderr，不经过stdio
+        static const char msg[] = "ConcurrentMalloc: failed to finish trace file, it is incomplete\n";
+        ssize_t w = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        (void)w;
+    }
+    close(sTraceFd);
+    sTraceFd = -1;
+}
+#endif
+
+extern "C"
+{
+    SHIM_EXPORT void *malloc(size_t size) noexcept
+    {
+        return ShimAlloc(size);
+    }
+
+    SHIM_EXPORT void free(void *ptr) noexcept
+    {
+        ShimFree(ptr);
+    }
+
+    SHIM_EXPORT void *calloc(size_t num, size_t size) noexcept
+    {
+        size_t bytes = 0;
+        if (__builtin_mul_overflow(num, size, &bytes))
+        {
+            errno = ENOMEM;
+            return nullptr;
+        }
+
+        void *ptr = ShimAlloc(bytes);
+        if (ptr)
+            memset(ptr, 0, bytes); // 块可能是复用的，不能假设已经清零
+        return ptr;
+    }
+
+    SHIM_EXPORT size_t malloc_usable_size(void *ptr) noexcept
+    {
+        if (ptr == nullptr)
+            return 0;
+        Span *span = OwnerSpan(ptr);
+        return span ? span->_objSize : 0;
+    }
+
+    SHIM_EXPORT void *realloc(void *ptr, size_t size) noexcept
+    {
+        if (ptr == nullptr)
+            return ShimAlloc(size);
+        if (size == 0)
+        {
+            ShimFree(ptr);
+            return nullptr;
+        }
+
+        size_t oldSize = malloc_usable_size(ptr);
+        if (oldSize == 0)
+        { // 不是内存池分配的，不知道原块有多大，无法搬移内容，按申请失败处理，原块保持不变
+            errno = ENOMEM;
+            return nullptr;
+        }
+        if (size <= oldSize && size > oldSize / 2)
+            return ptr; // 原块足够且不会浪费超过一半，原地返回
+
+        void *newPtr = ShimAlloc(size);
+        if (newPtr == nullptr)
+            return nullptr; // 失败时原块保持不变
+        memcpy(newPtr, ptr, size < oldSize ? size : oldSize);
+        ShimFree(ptr);
+        return newPtr;
+    }
+
+    SHIM_EXPORT void *reallocarray(void *ptr, size_t num, size_t size) noexcept
+    {
+        size_t bytes = 0;
+        if (__builtin_mul_overflow(num, size, &bytes))
+        {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        return realloc(ptr, bytes);
+    }
+
+    SHIM_EXPORT int posix_memalign(void **memptr, size_t align, size_t size) noexcept
+    {
+        if (align < sizeof(void *) || (align & (align - 1)) != 0)
+            return EINVAL;
+
+        int saved = errno; // posix_memalign通过返回值报告错误，不修改errno
+        void *ptr = ShimAllocAligned(align, size);
+        if (ptr == nullptr)
+        {
+            errno = saved;
+            return ENOMEM;
+        }
+        *memptr = ptr;
+        return 0;
+    }
+
+    SHIM_EXPORT void *aligned_alloc(size_t align, size_t size) noexcept
+    {
+        if (align == 0 || (align & (align - 1)) != 0)
+        {
+            errno = EINVAL;
+            return nullptr;
+        }
+        return ShimAllocAligned(align, size);
+    }
+
+    SHIM_EXPORT void *memalign(size_t align, size_t size) noexcept
+    {
+        return aligned_alloc(align, size);
+    }
+
+    SHIM_EXPORT void *valloc(size_t size) noexcept
+    {
+        return ShimAllocAligned(PAGE_BYTES, size);
+    }
+
+    SHIM_EXPORT void *pvalloc(size_t size) noexcept
+    {
+        return ShimAllocAligned(PAGE_BYTES, AlignSize(size, PAGE_BYTES));
+    }
+}
+
+SHIM_EXPORT void *operator new(size_t size)
+{
+    return NewImpl(size);
+}
+
+SHIM_EXPORT void *operator new[](size_t size)
+{
+    return NewImpl(size);
+}
+
+SHIM_EXPORT void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return NewNothrowImpl(size);
+}
+
+SHIM_EXPORT void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return NewNothrowImpl(size);
+}
+
+SHIM_EXPORT void *operator new(size_t size, std::align_val_t align)
+{
+    return NewImpl(size, (size_t)align);
+}
+
+SHIM_EXPORT void *operator new[](size_t size, std::align_val_t align)
+{
+    return NewImpl(size, (size_t)align);
+}
+
+SHIM_EXPORT void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+    return NewNothrowImpl(size, (size_t)align);
+}
+
+SHIM_EXPORT void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+    return NewNothrowImpl(size, (size_t)align);
+}
+
+SHIM_EXPORT void operator delete(void *ptr) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, size_t size) noexcept
+{
+    ShimFreeSized(ptr, size);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, size_t size) noexcept
+{
+    ShimFreeSized(ptr, size);
+}
+
+// 对齐版本可能走页级Span，释放时统一按Span记录的信息处理
+SHIM_EXPORT void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    ShimFree(ptr);
+}
+
+SHIM_EXPORT void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+    ShimFree(ptr);
+}
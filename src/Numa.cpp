@@ -0,0 +1,84 @@
+#include "../include/Numa.h"
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+size_t Numa::_nodeCount = 1;
+bool Numa::_simulated = false;
+pthread_once_t Numa::_initOnce = PTHREAD_ONCE_INIT;
+
+/// @brief 读取形如"0-1,3"的节点列表中最大的节点号，失败时返回0
+static size_t MaxOnlineNode()
+{
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    char buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    size_t maxNode = 0, cur = 0;
+    for (ssize_t i = 0; i <= n; ++i)
+    {
+        if (buf[i] >= '0' && buf[i] <= '9')
+        {
+            cur = cur * 10 + (buf[i] - '0');
+            continue;
+        }
+        if (cur > maxNode)
+            maxNode = cur;
+        cur = 0;
+    }
+    return maxNode;
+}
+
+void Numa::Init()
+{
+    // 不能调用malloc：替换了malloc时这里可能在第一次申请的路径上
+    const char *env = getenv("CONCURRENT_ALLOC_NUMA_NODES");
+    size_t nodes = 0;
+    if (env && *env)
+    {
+        nodes = strtoul(env, nullptr, 10);
+        _simulated = nodes > 0;
+    }
+    if (nodes == 0)
+        nodes = MaxOnlineNode() + 1;
+
+    if (nodes > NUMA_NODE_NUM)
+        nodes = NUMA_NODE_NUM;
+    _nodeCount = nodes;
+}
+
+size_t Numa::CurrentNode()
+{
+    size_t nodes = NodeCount();
+    if (nodes == 1)
+        return 0;
+
+    if (_simulated)
+    { // 按到达顺序轮流分配
+        static std::atomic<size_t> next{0};
+        return next.fetch_add(1, std::memory_order_relaxed) % nodes;
+    }
+
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return 0;
+    return node % nodes;
+}
+
+void Numa::BindToNode(void *ptr, size_t k, size_t node)
+{
+    if (NodeCount() == 1 || _simulated)
+        return;
+
+    const int MPOL_PREFERRED = 1; // 与<numaif.h>一致，不依赖libnuma
+    unsigned long mask = 1ul << node;
+    // 失败（例如内核不支持NUMA）时退化为首次访问时分配，不影响正确性
+    syscall(SYS_mbind, ptr, k << PAGE_SHIFT, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
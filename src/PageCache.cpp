@@ -1,92 +1,318 @@
 #include "../include/PageCache.h"
 
-PageCache PageCache::_sInst; // 饿汉模式下的单例
+// 显式写出“= {}”：GCC 12对没有初始化器的全局对象数组做常量初始化时，会丢掉元素中指向自身的指针
+CONSTINIT PageCache PageCache::_sInst[ARENA_NUM] = {};    // 饿汉模式下的各分片
+__thread PageCache *PageCache::_tArena = nullptr;         // 首次使用时绑定
+CONSTINIT PageMap<48 - PAGE_SHIFT> PageCache::_idSpanMap; // 所有分片共用的页号映射
+
+// 放在每个程序都会链接进来的编译单元中，静态库中单独的AtFork.o没有被引用时不会被链接
+__attribute__((constructor)) static void InitForkHandlers()
+{
+    RegisterForkHandlers();
+}
 
 Span *PageCache::NewSpan(size_t k)
 {
+    assert(k > 0);
+
+    // 超过128页的Span直接向系统申请，不进入_spanLists
+    if (k > PAGE_NUM)
+    {
+#ifdef HUGEPAGE_SPANS
+        // 按大页对齐，够一个大页的部分可以由透明大页承载
+        void *ptr = BindLocal(SystemAllocAligned(k, HUGE_PAGE_PAGES), k);
+        madvise(ptr, k << PAGE_SHIFT, MADV_HUGEPAGE);
+        return NewHugeSpan(ptr, k);
+#else
+        return NewHugeSpan(BindLocal(SystemAlloc(k), k), k);
+#endif
+    }
+
+    size_t i = FindFreeList(k);
+
     // ① k号桶中有Span
-    if (!_spanLists[k].empty())
+    if (i == k)
     {
         Span *span = _spanLists[k].pop_front();
+        span->_isReturned = false; // 已还给系统的页再次访问时由内核重新映射
+        AddUsedPages(span, k);
 
         // 记录分配出去的Span管理的页号和其地址的映射关系
         for (PageID i = 0; i < span->_n; ++i)
         {
-            _idSpanMap[span->_pageID + i] = span;
+            _idSpanMap.set(span->_pageID + i, span);
         }
 
         return span;
     }
     // ② k号桶中没有Span，但是后面的桶有
-    for (int i = k + 1; i <= PAGE_NUM; ++i)
+    if (i != 0)
     {
-        if (!_spanLists[i].empty())
+        Span *nSpan = _spanLists[i].pop_front();
+
+        // 分成一个k页Span和一个i-k页Span
+        Span *kSpan = _spanPool.New();
+        kSpan->_pageID = nSpan->_pageID;
+        kSpan->_n = k;
+        kSpan->_arena = ArenaIndex();
+#ifdef HUGEPAGE_SPANS
+        kSpan->_huge = nSpan->_huge;
+#endif
+        AddUsedPages(kSpan, k); // 先计入，剩下的部分按部分使用的大页挂回去
+
+        nSpan->_pageID += k;
+        nSpan->_n -= k;
+
+        PushFree(nSpan);
+
+        // 映射边缘页，方便回收Span时进行合并
+        // 只需要映射被拆分后剩下的Span的边缘页，因为回收时待合并的Span都是被分配出去的
+        _idSpanMap.set(nSpan->_pageID, nSpan);
+        _idSpanMap.set(nSpan->_pageID + nSpan->_n - 1, nSpan);
+
+        for (PageID i = 0; i < kSpan->_n; ++i)
         {
-            Span *nSpan = _spanLists[i].pop_front();
+            _idSpanMap.set(kSpan->_pageID + i, kSpan);
+        }
+
+        return kSpan;
+    }
+    // ③ 都没有Span，向系统申请一块新的区域，然后再拆分
+    NewRegion();
+
+    // 递归后必走②
+    return NewSpan(k); // 复用代码
+}
+
+size_t PageCache::FindFreeList(size_t k)
+{
+#ifdef HUGEPAGE_SPANS
+    // 各桶中完全空闲的大页排在最后，桶首的Span所在大页已部分使用时优先选它，
+    // 尽量把小Span挤进已经拆开的大页，没有时才拆一个新的大页
+    size_t first = 0;
+    for (size_t i = k; i <= PAGE_NUM; ++i)
+    {
+        if (_spanLists[i].empty())
+            continue;
+        if (first == 0)
+            first = i;
+        HugePage *huge = _spanLists[i].begin()->_huge;
+        if (huge == nullptr || huge->_usedPages > 0)
+            return i;
+    }
+    return first;
+#else
+    for (size_t i = k; i <= PAGE_NUM; ++i)
+    {
+        if (!_spanLists[i].empty())
+            return i;
+    }
+    return 0;
+#endif
+}
+
+void PageCache::NewRegion()
+{
+#ifdef HUGEPAGE_SPANS
+    // 一次申请一个2MB对齐的大页，拆成若干个128页的Span；合并仍限制在128页区域内
+    void *ptr = BindLocal(SystemAllocAligned(HUGE_PAGE_PAGES, HUGE_PAGE_PAGES), HUGE_PAGE_PAGES);
+    madvise(ptr, HUGE_PAGE_PAGES << PAGE_SHIFT, MADV_HUGEPAGE);
 
-            // 分成一个k页Span和一个i-k页Span
-            Span *kSpan = new Span;
-            kSpan->_pageID = nSpan->_pageID;
-            kSpan->_n = k;
+    HugePage *huge = _hugePool.New();
+    huge->_base = ((PageID)ptr) >> PAGE_SHIFT;
+    huge->_freeEpoch = _scavengeEpoch;
+    huge->_next = _hugePages;
+    if (_hugePages)
+        _hugePages->_prev = huge;
+    _hugePages = huge;
 
-            nSpan->_pageID += k;
-            nSpan->_n -= k;
+    for (size_t i = 0; i < HUGE_PAGE_PAGES / PAGE_NUM; ++i)
+    {
+        Span *span = _spanPool.New();
+        span->_pageID = huge->_base + i * PAGE_NUM;
+        span->_n = PAGE_NUM;
+        span->_arena = ArenaIndex();
+        span->_freeEpoch = _scavengeEpoch;
+        span->_huge = huge;
+        _idSpanMap.set(span->_pageID, span); // 整个大页归还时通过首页找到各个Span
+        PushFree(span);
+    }
+#else
+    // 向系统申请128页对齐的128页空间
+    void *ptr = BindLocal(SystemAllocAligned(PAGE_NUM, PAGE_NUM), PAGE_NUM);
+    Span *bigSpan = _spanPool.New();
+    bigSpan->_pageID = ((PageID)ptr) >> PAGE_SHIFT; // mmap分配的页面一定是对齐的
+    bigSpan->_n = PAGE_NUM;
+    bigSpan->_arena = ArenaIndex();
+    bigSpan->_freeEpoch = _scavengeEpoch;
+    _spanLists[bigSpan->_n].push_front(bigSpan);
+#endif
+}
+
+Span *PageCache::NewSpanAligned(size_t k, size_t alignPages)
+{
+    assert(k > 0);
+    assert((alignPages & (alignPages - 1)) == 0);
 
-            _spanLists[nSpan->_n].push_front(nSpan);
+    if (alignPages <= 1)
+        return NewSpan(k);
 
-            // 映射边缘页，方便回收Span时进行合并
-            // 只需要映射被拆分后剩下的Span的边缘页，因为回收时待合并的Span都是被分配出去的
-            _idSpanMap[nSpan->_pageID] = nSpan;
-            _idSpanMap[nSpan->_pageID + nSpan->_n - 1] = nSpan;
+    // 超过128页的Span直接向系统申请对齐的空间，多映射的首尾部分当场解除映射
+    if (k > PAGE_NUM)
+    {
+        return NewHugeSpan(BindLocal(SystemAllocAligned(k, alignPages), k), k);
+    }
 
-            for (PageID i = 0; i < kSpan->_n; ++i)
+    // 在空闲Span中找一段起始页对齐的k页空间
+    // 不少于k+alignPages-1页的Span中一定有，更短的Span要看起始页的位置
+    if (alignPages <= PAGE_NUM)
+    {
+        for (size_t i = k; i <= PAGE_NUM; ++i)
+        {
+            for (Span *it = _spanLists[i].begin(); it != _spanLists[i].end(); it = it->next)
             {
-                _idSpanMap[kSpan->_pageID + i] = kSpan;
+                PageID start = (it->_pageID + alignPages - 1) & ~(PageID)(alignPages - 1);
+                if (start + k <= it->_pageID + it->_n)
+                {
+                    _spanLists[i].erase(it);
+                    return SplitSpan(it, start, k);
+                }
             }
-
-            return kSpan;
         }
     }
-    // ③ 都没有Span，向系统申请128页空间，然后再拆分
-    void *ptr = SystemAlloc(PAGE_NUM);
-    Span *bigSpan = new Span;
-    bigSpan->_pageID = ((PageID)ptr) >> PAGE_SHIFT; // 系统分配的页面一定是对齐的
+
+#ifdef HUGEPAGE_SPANS
+    // 新大页中的128页Span都是128页对齐的，重新查找时一定能找到
+    if (alignPages <= PAGE_NUM)
+    {
+        NewRegion();
+        return NewSpanAligned(k, alignPages);
+    }
+#endif
+
+    // 没有合适的Span，向系统申请一块新的区域，起始页同时按128页和alignPages页对齐
+    void *ptr = BindLocal(SystemAllocAligned(PAGE_NUM, alignPages > PAGE_NUM ? alignPages : PAGE_NUM), PAGE_NUM);
+    Span *bigSpan = _spanPool.New();
+    bigSpan->_pageID = ((PageID)ptr) >> PAGE_SHIFT;
     bigSpan->_n = PAGE_NUM;
-    _spanLists[bigSpan->_n].push_front(bigSpan);
+    bigSpan->_arena = ArenaIndex();
+    bigSpan->_freeEpoch = _scavengeEpoch;
 
-    // 递归后必走②
-    return NewSpan(k); // 复用代码
+    return SplitSpan(bigSpan, bigSpan->_pageID, k);
 }
 
-Span *PageCache::MapObjectToSpan(void *obj)
+Span *PageCache::NewHugeSpan(void *ptr, size_t k)
 {
-    // 找到页号
-    PageID id = ((PageID)obj) >> PAGE_SHIFT;
+    Span *span = _spanPool.New();
+    span->_pageID = ((PageID)ptr) >> PAGE_SHIFT;
+    span->_n = k;
+    span->_arena = ArenaIndex();
 
-    auto ret = _idSpanMap.find(id);
+    // 只映射首页，释放时通过起始地址就能找到Span
+    _idSpanMap.set(span->_pageID, span);
+
+    return span;
+}
 
-    if (ret == _idSpanMap.end())
+Span *PageCache::SplitSpan(Span *span, PageID pageID, size_t k)
+{
+    assert(pageID >= span->_pageID);
+    assert(pageID + k <= span->_pageID + span->_n);
+    AddUsedPages(span, k); // 先计入，切下的前后部分按部分使用的大页挂回去
+
+    // 切下前面多出的页
+    if (pageID > span->_pageID)
     {
-        assert(false);
-        return nullptr;
+        Span *headSpan = _spanPool.New();
+        headSpan->_pageID = span->_pageID;
+        headSpan->_n = pageID - span->_pageID;
+        headSpan->_arena = ArenaIndex();
+        headSpan->_isReturned = span->_isReturned;
+        headSpan->_freeEpoch = span->_freeEpoch;
+#ifdef HUGEPAGE_SPANS
+        headSpan->_huge = span->_huge;
+#endif
+
+        span->_pageID = pageID;
+        span->_n -= headSpan->_n;
+
+        PushFree(headSpan);
+        _idSpanMap.set(headSpan->_pageID, headSpan);
+        _idSpanMap.set(headSpan->_pageID + headSpan->_n - 1, headSpan);
     }
 
-    return ret->second;
+    // 切下后面多出的页
+    if (span->_n > k)
+    {
+        Span *tailSpan = _spanPool.New();
+        tailSpan->_pageID = span->_pageID + k;
+        tailSpan->_n = span->_n - k;
+        tailSpan->_arena = ArenaIndex();
+        tailSpan->_isReturned = span->_isReturned;
+        tailSpan->_freeEpoch = span->_freeEpoch;
+#ifdef HUGEPAGE_SPANS
+        tailSpan->_huge = span->_huge;
+#endif
+
+        span->_n = k;
+
+        PushFree(tailSpan);
+        _idSpanMap.set(tailSpan->_pageID, tailSpan);
+        _idSpanMap.set(tailSpan->_pageID + tailSpan->_n - 1, tailSpan);
+    }
+
+    span->_isReturned = false;
+    for (PageID i = 0; i < span->_n; ++i)
+    {
+        _idSpanMap.set(span->_pageID + i, span);
+    }
+
+    return span;
+}
+
+Span *PageCache::MapObjectToSpan(void *obj)
+{
+    // 找到页号
+    PageID id = ((PageID)obj) >> PAGE_SHIFT;
+
+    // 基数树的读不需要_pageMtx，写入方保证节点发布后不再移动
+    Span *span = _idSpanMap.get(id);
+    assert(span);
+    return span;
 }
 
 void PageCache::ReleaseSpanToPageCache(Span *span)
 {
+    // 超过128页的Span直接还给系统
+    if (span->_n > PAGE_NUM)
+    {
+        _idSpanMap.set(span->_pageID, nullptr);
+        SystemFree((void *)(span->_pageID << PAGE_SHIFT), span->_n);
+        _spanPool.Delete(span);
+        return;
+    }
+
+    size_t freedPages = span->_n;
+    AddUsedPages(span, -(ptrdiff_t)span->_n);
+#ifdef HUGEPAGE_SPANS
+    if (span->_huge && span->_huge->_usedPages == 0)
+        span->_huge->_freeEpoch = _scavengeEpoch; // 整个大页空闲了，从这个周期开始计算空闲时长
+#endif
+
     // 向左不断合并
     while (1)
     {
+        // 已经到达128页对齐区域的左边界，左边的页可能属于其它分片，停止合并
+        if (span->_pageID % PAGE_NUM == 0)
+            break;
+
         PageID leftID = span->_pageID - 1; // 左边相邻页id
-        auto ret = _idSpanMap.find(leftID);
+        Span *leftSpan = _idSpanMap.get(leftID);
         // 没有相邻Span，停止合并
-        if (ret == _idSpanMap.end())
+        if (leftSpan == nullptr)
             break;
 
         // 相邻Span在cc中，停止合并
-        Span *leftSpan = ret->second;
         if (leftSpan->_isUse)
             break;
 
@@ -98,23 +324,25 @@ void PageCache::ReleaseSpanToPageCache(Span *span)
         span->_pageID = leftSpan->_pageID;
         span->_n += leftSpan->_n;
 
-        _idSpanMap.erase(leftSpan->_pageID);
+        _idSpanMap.set(leftSpan->_pageID, nullptr);
         _spanLists[leftSpan->_n].erase(leftSpan);
-        delete leftSpan;
+        _spanPool.Delete(leftSpan);
     }
 
     // 向右不断合并
     while (1)
     {
         PageID rightID = span->_pageID + span->_n;
-        auto ret = _idSpanMap.find(rightID);
+        // 已经到达128页对齐区域的右边界，停止合并
+        if (rightID % PAGE_NUM == 0)
+            break;
 
+        Span *rightSpan = _idSpanMap.get(rightID);
         // 没有相邻Span，停止合并
-        if (ret == _idSpanMap.end())
+        if (rightSpan == nullptr)
             break;
 
         // 相邻Span在cc中，停止合并
-        Span *rightSpan = ret->second;
         if (rightSpan->_isUse)
             break;
 
@@ -125,16 +353,146 @@ void PageCache::ReleaseSpanToPageCache(Span *span)
         // 当前Span与相邻Span合并
         span->_n += rightSpan->_n;
 
-        _idSpanMap.erase(rightSpan->_pageID);
+        _idSpanMap.set(rightSpan->_pageID, nullptr);
         _spanLists[rightSpan->_n].erase(rightSpan);
-        delete rightSpan;
+        _spanPool.Delete(rightSpan);
     }
 
     // 合并完毕，将当前Span挂到对应桶中
-    _spanLists[span->_n].push_front(span);
+    // 刚还回来的页一定还驻留在内存中，合并后整体按未归还处理，交给后续回收周期再madvise
     span->_isUse = false;
+    PushFree(span);
+    span->_isLarge = false;
+    span->_isReturned = false;
+    span->_freeEpoch = _scavengeEpoch;
 
     // 映射边缘页，方便后续其它Span的合并
-    _idSpanMap[span->_pageID] = span;
-    _idSpanMap[span->_pageID + span->_n - 1] = span;
-}
\ No newline at end of file
+    _idSpanMap.set(span->_pageID, span);
+    _idSpanMap.set(span->_pageID + span->_n - 1, span);
+
+    // 还回来的页数累计到一定量后，回收一次长时间空闲的Span
+    _pagesSinceScavenge += freedPages;
+    if (_pagesSinceScavenge >= SCAVENGE_PAGES)
+        ReleaseIdleSpans();
+}
+
+void PageCache::ReleaseIdleSpans(bool force)
+{
+    ++_scavengeEpoch;
+    _pagesSinceScavenge = 0;
+
+#ifdef HUGEPAGE_SPANS
+    // 完全空闲了一个回收周期以上的大页整个解除映射
+    for (HugePage *huge = _hugePages; huge != nullptr;)
+    {
+        HugePage *next = huge->_next;
+        if (huge->_usedPages == 0 && (force || huge->_freeEpoch + 1 < _scavengeEpoch))
+            ReleaseHugePage(huge);
+        huge = next;
+    }
+#endif
+
+    for (size_t i = 1; i <= PAGE_NUM; ++i)
+    {
+        Span *it = _spanLists[i].begin();
+        while (it != _spanLists[i].end())
+        {
+            Span *next = it->next;
+
+            // 上个回收周期之后才挂进来的Span可能马上会被复用，先保留
+            if (!force && it->_freeEpoch + 1 >= _scavengeEpoch)
+            {
+                it = next;
+                continue;
+            }
+
+            void *ptr = (void *)(it->_pageID << PAGE_SHIFT);
+#ifdef HUGEPAGE_SPANS
+            if (it->_huge)
+            { // 部分使用的大页中的空闲Span平时保留，归还4KB页会把大页拆散；强制回收时才归还物理页
+                if (force && !it->_isReturned)
+                {
+                    SystemRelease(ptr, it->_n);
+                    it->_isReturned = true;
+                }
+                it = next;
+                continue;
+            }
+#endif
+            if (it->_n == PAGE_NUM)
+            { // 已经完全合并的128页Span就是一整块区域，直接解除映射
+                _spanLists[i].erase(it);
+
+                // 整段清空映射，防止地址被系统复用后查到已删除的Span
+                for (PageID j = 0; j < it->_n; ++j)
+                {
+                    _idSpanMap.set(it->_pageID + j, nullptr);
+                }
+
+                SystemFree(ptr, it->_n);
+                _spanPool.Delete(it);
+            }
+            else if (!it->_isReturned)
+            { // 其余Span保留地址空间，只归还物理页
+                SystemRelease(ptr, it->_n);
+                it->_isReturned = true;
+            }
+
+            it = next;
+        }
+    }
+}
+
+#ifdef HUGEPAGE_SPANS
+void PageCache::ReleaseHugePage(HugePage *huge)
+{
+    // 大页完全空闲时，其中每个128页区域都已合并成一个空闲Span
+    for (size_t i = 0; i < HUGE_PAGE_PAGES / PAGE_NUM; ++i)
+    {
+        Span *span = _idSpanMap.get(huge->_base + i * PAGE_NUM);
+        assert(span && !span->_isUse && span->_n == PAGE_NUM && span->_huge == huge);
+
+        _spanLists[PAGE_NUM].erase(span);
+        for (PageID j = 0; j < span->_n; ++j)
+        {
+            _idSpanMap.set(span->_pageID + j, nullptr);
+        }
+        _spanPool.Delete(span);
+    }
+    SystemFree((void *)(huge->_base << PAGE_SHIFT), HUGE_PAGE_PAGES);
+
+    if (huge->_prev)
+        huge->_prev->_next = huge->_next;
+    else
+        _hugePages = huge->_next;
+    if (huge->_next)
+        huge->_next->_prev = huge->_prev;
+    _hugePool.Delete(huge);
+}
+#endif
+
+void PageCache::CollectStats(ArenaStats &stats)
+{
+    for (size_t i = 1; i <= PAGE_NUM; ++i)
+    {
+        for (Span *it = _spanLists[i].begin(); it != _spanLists[i].end(); it = it->next)
+        {
+            ++stats._freeSpans[i];
+            stats._freePages += i;
+            if (it->_isReturned)
+                stats._returnedPages += i;
+        }
+    }
+    stats._lock._acquires = _pageMtx.Acquires();
+    stats._lock._contended = _pageMtx.Contended();
+}
+
+#ifdef HARDENED_FREELIST
+void CheckFreeLink(void *obj)
+{
+    Span *span = PageCache::_idSpanMap.get((PageID)obj >> PAGE_SHIFT);
+    if (span == nullptr || !span->_isUse || span->_isLarge || span->_objSize == 0 ||
+        ((char *)obj - (char *)(span->_pageID << PAGE_SHIFT)) % span->_objSize != 0)
+        FreeListCorrupted(obj);
+}
+#endif
@@ -1,20 +1,118 @@
 #include "../include/ThreadCache.h"
+#include "../include/PageCache.h"
+
+__thread ThreadCache *pTLSThreadCache = nullptr;
+
+ThreadCache *ThreadCache::_sHead = nullptr;
+CONSTINIT std::mutex ThreadCache::_sMtx;
+CONSTINIT ObjectPool<ThreadCache> ThreadCache::_sPool;
+pthread_key_t ThreadCache::_sKey;
+pthread_once_t ThreadCache::_sKeyOnce = PTHREAD_ONCE_INIT;
+
+/// @brief 为当前线程创建tc并设置pTLSThreadCache
+ThreadCache *ThreadCache::Create()
+{
+    pthread_once(&_sKeyOnce, []()
+    { pthread_key_create(&_sKey, ThreadExit); });
+
+    _sMtx.lock();
+    ThreadCache *tc = _sPool.New();
+    // 头插到全局链表
+    tc->_next = _sHead;
+    if (_sHead)
+        _sHead->_prev = tc;
+    _sHead = tc;
+    _sMtx.unlock();
+
+    // 先挂到TLS上：pthread_setspecific可能调用calloc，替换了malloc时会重入这里
+    pTLSThreadCache = tc;
+
+    // 线程退出时pthread会以tc为参数调用ThreadExit
+    pthread_setspecific(_sKey, tc);
+    return tc;
+}
+
+/// @brief 清空tc并回收到池中
+void ThreadCache::Destroy(ThreadCache *tc)
+{
+    tc->Drain();
+
+    _sMtx.lock();
+    if (tc->_prev)
+        tc->_prev->_next = tc->_next;
+    else
+        _sHead = tc->_next;
+    if (tc->_next)
+        tc->_next->_prev = tc->_prev;
+    _sPool.Delete(tc);
+    _sMtx.unlock();
+}
+
+/// @brief 线程退出钩子
+void ThreadCache::ThreadExit(void *arg)
+{
+    // 先置空，退出过程中如果还有申请会重新创建tc并再次挂上钩子
+    pTLSThreadCache = nullptr;
+    Destroy((ThreadCache *)arg);
+}
+
+/// @brief 通知所有存活的tc清空自己
+/// @details tc的自由链表不加锁，只能由所属线程操作，这里只设置标记
+void ThreadCache::RequestDrainAll()
+{
+    std::lock_guard<std::mutex> lock(_sMtx);
+    for (ThreadCache *tc = _sHead; tc; tc = tc->_next)
+    {
+        tc->_drainRequested.store(true, std::memory_order_relaxed);
+    }
+}
+
+/// @brief 汇总所有存活tc中缓存的块
+/// @details 持有_sMtx期间tc不会被回收；自由链表长度由所属线程修改，这里按relaxed读取原子变量，得到的是近似值
+void ThreadCache::CollectAllStats(AllocatorStats &stats)
+{
+    std::lock_guard<std::mutex> lock(_sMtx);
+    for (ThreadCache *tc = _sHead; tc; tc = tc->_next)
+    {
+        tc->CollectStats(stats);
+    }
+}
+
+void ThreadCache::ForkLock()
+{
+    _sMtx.lock();
+}
+
+void ThreadCache::ForkUnlock()
+{
+    _sMtx.unlock();
+}
+
+void ThreadCache::CollectStats(AllocatorStats &stats)
+{
+    ++stats._threadCaches;
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        size_t n = _freeLists[i].size();
+        stats._classes[i]._tcObjects += n;
+        stats._classes[i]._tcBytes += n * stats._classes[i]._size;
+    }
+}
 
 /// @brief 线程申请size大小的空间
 void *ThreadCache::Allocate(size_t size)
 {
-    assert(size < MAX_BYTES); // 线程单次不能申请超过256KB的空间
+    assert(size <= MAX_BYTES); // 线程单次不能申请超过256KB的空间，更大的空间由ConcurrentAlloc直接向pc申请
 
-    size_t alignSize = SizeClass::RoundUp(size); // 拿到对齐后的大学
-    size_t index = SizeClass::Index(size);       // 拿到对应桶下标
+    size_t index = SizeClass::Index(size); // 一次查表拿到对应桶下标
 
     if (!_freeLists[index].empty())
     { // 自由链表不为空，直接从链表中获取空间
         return _freeLists[index].pop();
     }
     else
-    { // 自由链表为空，向CentralCache中申请空间
-        return FetchFromCentralCache(index, alignSize);
+    { // 自由链表为空，向CentralCache中申请空间，对齐后的大小只在慢路径上查
+        return FetchFromCentralCache(index, SizeClass::ClassSize(index));
     }
 }
 
@@ -24,7 +122,6 @@ void ThreadCache::Deallocate(void *obj, size_t size)
     assert(obj);               // 回收空间不能为空
     assert(size <= MAX_BYTES); // 回收空间不能超过256KB
 
-    // size可以保证已经是对齐的
     size_t index = SizeClass::Index(size); // 找到对应自由链表的下标
     _freeLists[index].push(obj);           // 用对应自由链表回收obj
 
@@ -33,11 +130,104 @@ void ThreadCache::Deallocate(void *obj, size_t size)
     {
         ListTooLong(_freeLists[index], size);
     }
+
+    // 周期性地收缩长期用不到的块，避免只回收不申请的线程囤积空间
+    if (--_scavengeCountdown == 0)
+    {
+        Scavenge();
+    }
+
+    // 其它线程调用了ReleaseAllThreadCaches
+    if (_drainRequested.load(std::memory_order_relaxed))
+    {
+        Drain();
+    }
+}
+
+/// @brief 申请n块size大小的空间写入objs
+/// @details 先从自由链表整段取出，不够的部分直接向cc整批申请后写入objs，不经过自由链表
+void ThreadCache::AllocateBatch(size_t size, void **objs, size_t n)
+{
+    assert(size <= MAX_BYTES);
+
+    size_t index = SizeClass::Index(size);
+    FreeList &list = _freeLists[index];
+
+    size_t got = std::min(n, list.size());
+    if (got > 0)
+        list.PopBatch(objs, got);
+    if (got == n)
+        return;
+
+    if (_drainRequested.load(std::memory_order_relaxed))
+    {
+        Drain();
+    }
+
+    size_t alignSize = SizeClass::ClassSize(index);
+    CentralCache *cc = CentralCache::GetInstance();
+    while (got < n)
+    { // 一个Span中的块不够时cc会少给，继续要
+        void *start = nullptr;
+        void *end = nullptr;
+        size_t actualNum = cc->FetchRangeObj(start, end, n - got, alignSize);
+
+        void *obj = start;
+        size_t take = std::min(actualNum, n - got);
+        for (size_t i = 0; i < take; ++i)
+        {
+            objs[got++] = obj;
+            obj = LoadNext(obj);
+        }
+
+        // 从中转缓存拿到的是别人整批还回来的块，可能比要的多，多出的留在自由链表中
+        if (take < actualNum)
+            list.pushRange(obj, end, actualNum - take);
+    }
+}
+
+/// @brief 回收objs中n块大小为size的空间
+/// @details 在objs中串成一条链表后一次挂到自由链表上，超出上限的部分整批还给cc
+void ThreadCache::DeallocateBatch(void **objs, size_t n, size_t size)
+{
+    assert(n > 0);
+    assert(size <= MAX_BYTES);
+
+    for (size_t i = 0; i + 1 < n; ++i)
+    {
+        StoreNext(objs[i], objs[i + 1]);
+    }
+
+    size_t index = SizeClass::Index(size);
+    FreeList &list = _freeLists[index];
+    list.pushRange(objs[0], objs[n - 1], n);
+
+    // 一次可能放进很多块，反复归还直到低于上限
+    while (list.size() >= list.MaxSize())
+    {
+        ListTooLong(list, size);
+    }
+
+    if (_scavengeCountdown <= n)
+        Scavenge();
+    else
+        _scavengeCountdown -= n;
+
+    if (_drainRequested.load(std::memory_order_relaxed))
+    {
+        Drain();
+    }
 }
 
 /// @brief ThreadCache空间不够时，向CentralCache申请空间
 void *ThreadCache::FetchFromCentralCache(size_t index, size_t alignSize)
 {
+    // 其它线程调用了ReleaseAllThreadCaches，补充前先把其余桶清空
+    if (_drainRequested.load(std::memory_order_relaxed))
+    {
+        Drain();
+    }
+
     // 通过MaxSize和NumMoveSize来控制当前分配的块数
     size_t batchNum = std::min(_freeLists[index].MaxSize(), SizeClass::NumMoveSize(alignSize)); // 取最小值是防止MaxSize一直递加过大
 
@@ -58,18 +248,75 @@ void *ThreadCache::FetchFromCentralCache(size_t index, size_t alignSize)
     if (actualNum == 1)
         assert(start == end);
     else
-        _freeLists[index].pushRange(ObjNext(start), end, actualNum - 1); // 将多余块放入自由链表中
+        _freeLists[index].pushRange(LoadNext(start), end, actualNum - 1); // 将多余块放入自由链表中
 
     // 返回第一块给线程
     return start;
 }
 
-void ThreadCache::ListTooLong(FreeList &list, size_t n)
+/// @brief 自由链表过长时，向cc归还一批块
+void ThreadCache::ListTooLong(FreeList &list, size_t size)
+{
+    size_t batchNum = SizeClass::NumMoveSize(size);
+
+    // 归还MaxSize块，此时链表中只剩下不足一批的块
+    ReleaseToCentralCache(list, std::min(list.MaxSize(), list.size()), size);
+
+    // 与FetchFromCentralCache一样慢开始，只回收不申请的线程也能逐步过渡到整批归还
+    if (list.MaxSize() < batchNum)
+        list.MaxSize()++;
+}
+
+/// @brief 按低水位线收缩各个自由链表，整个周期都没被用到的块还一半给cc
+void ThreadCache::Scavenge()
 {
+    _scavengeCountdown = TC_SCAVENGE_FREES;
+
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        FreeList &list = _freeLists[i];
+        size_t lowWater = list.LowWater();
+        if (lowWater > 0)
+        {
+            size_t drop = lowWater > 1 ? lowWater / 2 : 1;
+            size_t size = PageCache::MapObjectToSpan(list.front())->_objSize; // 桶中块的大小
+            ReleaseToCentralCache(list, drop, size);
+
+            // 链表长期用不满，同时降低水位上限，避免下一次又囤积回来
+            if (list.MaxSize() > 1)
+                list.MaxSize() /= 2;
+        }
+        list.ResetLowWater();
+    }
+}
+
+/// @brief 将所有自由链表中的块还给cc，线程退出或收到清空请求时调用
+void ThreadCache::Drain()
+{
+    _drainRequested.store(false, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        FreeList &list = _freeLists[i];
+        if (!list.empty())
+        {
+            size_t size = PageCache::MapObjectToSpan(list.front())->_objSize;
+            ReleaseToCentralCache(list, list.size(), size);
+        }
+        list.MaxSize() = 1; // 重新慢开始
+        list.ResetLowWater();
+    }
+}
+
+/// @brief 从list中取出n块还给cc
+void ThreadCache::ReleaseToCentralCache(FreeList &list, size_t n, size_t size)
+{
+    if (n == 0)
+        return;
+
     void *start = nullptr;
     void *end = nullptr;
+    list.PopRange(start, end, n);
 
-    list.PopRange(start, end, list.MaxSize());
-
-    
-}
\ No newline at end of file
+    CentralCache::GetInstance()->ReleaseRangeObj(start, end, n, size);
+}
@@ -0,0 +1,494 @@
+#include "../include/ConcurrentAlloc.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <malloc.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// 多线程基准测试：同一次运行中对比ConcurrentAlloc/ConcurrentFree与系统malloc/free
+// 用法：Benchmark [线程数] [每线程操作数] [负载名]
+// 每个(负载, 分配器)组合在单独的子进程中运行，峰值RSS互不影响
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t SAMPLE_MASK = 15; // 每16次调用采样一次延迟，减小计时本身的开销
+
+/// @brief 读取当前进程的常驻内存（KB）
+size_t CurrentRSS()
+{
+    size_t pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+        return 0;
+    if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/// @brief 读取当前进程的峰值常驻内存（KB）
+size_t PeakRSS()
+{
+    size_t kb = 0;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == nullptr)
+        return 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, "VmHWM:", 6) == 0)
+        {
+            sscanf(line + 6, "%zu", &kb);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+/// @brief 内存池
+struct PoolAllocator
+{
+    static const char *Name() { return "ConcurrentAlloc"; }
+    static void *Alloc(size_t size) { return ConcurrentAlloc(size); }
+    static void Free(void *obj, size_t size) { ConcurrentFree(obj, size); }
+    static void AllocBatch(size_t size, void **objs, size_t n) { ConcurrentAllocBatch(size, objs, n); }
+    static void FreeBatch(void **objs, size_t n, size_t size) { ConcurrentFreeBatch(objs, n, size); }
+    static void Release()
+    {
+        ReleaseAllThreadCaches();
+        ConcurrentReleaseFreeMemory();
+    }
+};
+
+/// @brief 系统malloc
+struct SystemAllocator
+{
+    static const char *Name() { return "malloc"; }
+    static void *Alloc(size_t size) { return malloc(size); }
+    static void Free(void *obj, size_t) { free(obj); }
+    static void AllocBatch(size_t size, void **objs, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+            objs[i] = malloc(size);
+    }
+    static void FreeBatch(void **objs, size_t n, size_t)
+    {
+        for (size_t i = 0; i < n; ++i)
+            free(objs[i]);
+    }
+    static void Release() { malloc_trim(0); }
+};
+
+/// @brief 每个线程的统计结果
+struct ThreadStat
+{
+    size_t _ops = 0;       // 申请和释放的总次数
+    vector<uint32_t> _lat; // 采样到的单次调用延迟（ns）
+};
+
+/// @brief 简单的线程私有随机数（xorshift）
+struct Rand
+{
+    uint64_t _s;
+    explicit Rand(uint64_t seed) : _s(seed * 2654435761u + 88172645463325252ull) {}
+    uint64_t Next()
+    {
+        _s ^= _s << 13;
+        _s ^= _s >> 7;
+        _s ^= _s << 17;
+        return _s;
+    }
+};
+
+/// @brief 所有桶各取一个代表大小（桶内最大的对齐大小）
+vector<size_t> ClassSizes()
+{
+    vector<size_t> sizes(FREE_LIST_NUM, 0);
+    for (size_t size = 1; size <= MAX_BYTES; ++size)
+    {
+        size_t index = SizeClass::Index(size);
+        sizes[index] = std::max(sizes[index], SizeClass::RoundUp(size));
+    }
+    sizes.erase(std::remove(sizes.begin(), sizes.end(), 0), sizes.end());
+    return sizes;
+}
+
+/// @brief 计时并按需采样一次调用
+template <class F>
+inline void Timed(ThreadStat &st, F &&f)
+{
+    if ((st._ops & SAMPLE_MASK) == 0)
+    {
+        auto begin = Clock::now();
+        f();
+        auto end = Clock::now();
+        st._lat.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+    }
+    else
+    {
+        f();
+    }
+    ++st._ops;
+}
+
+/// @brief 计时一次批量调用，按块数折算成单次延迟
+template <class F>
+inline void TimedBatch(ThreadStat &st, size_t n, F &&f)
+{
+    if ((st._ops & ~SAMPLE_MASK) != ((st._ops + n) & ~SAMPLE_MASK))
+    { // 跨过采样点时计时
+        auto begin = Clock::now();
+        f();
+        auto end = Clock::now();
+        st._lat.push_back((uint32_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() / n));
+    }
+    else
+    {
+        f();
+    }
+    st._ops += n;
+}
+
+/// @brief 固定大小反复申请释放
+template <class A>
+void FixedChurn(size_t, size_t ops, ThreadStat &st, size_t)
+{
+    const size_t Size = 64;
+    const size_t Live = 128; // 同时持有的块数
+    void *objs[Live] = {};
+
+    for (size_t i = 0; i < ops / 2; ++i)
+    {
+        size_t slot = i % Live;
+        if (objs[slot])
+            Timed(st, [&]() { A::Free(objs[slot], Size); });
+        Timed(st, [&]() { objs[slot] = A::Alloc(Size); });
+        *(char *)objs[slot] = 1;
+    }
+    for (size_t i = 0; i < Live; ++i)
+    {
+        if (objs[i])
+            A::Free(objs[i], Size);
+    }
+}
+
+/// @brief 在所有SizeClass桶中随机选大小
+template <class A>
+void RandomSizes(size_t tid, size_t ops, ThreadStat &st, size_t)
+{
+    static const vector<size_t> sizes = ClassSizes();
+    const size_t Live = 256;
+    void *objs[Live] = {};
+    size_t objSizes[Live] = {};
+    Rand rnd(tid + 1);
+
+    for (size_t i = 0; i < ops / 2; ++i)
+    {
+        size_t slot = rnd.Next() % Live;
+        if (objs[slot])
+            Timed(st, [&]() { A::Free(objs[slot], objSizes[slot]); });
+        objSizes[slot] = sizes[rnd.Next() % sizes.size()];
+        Timed(st, [&]() { objs[slot] = A::Alloc(objSizes[slot]); });
+        *(char *)objs[slot] = 1;
+    }
+    for (size_t i = 0; i < Live; ++i)
+    {
+        if (objs[i])
+            A::Free(objs[i], objSizes[i]);
+    }
+}
+
+/// @brief 生产者/消费者：偶数线程申请，相邻的奇数线程释放
+template <class A>
+void ProducerConsumer(size_t tid, size_t ops, ThreadStat &st, size_t nthreads)
+{
+    struct Channel
+    {
+        std::mutex _mtx;
+        std::condition_variable _cv;
+        std::deque<vector<void *>> _queue;
+        bool _done = false;
+    };
+    static Channel channels[1024];
+
+    const size_t Batch = 256;
+    const size_t Size = 128;
+
+    Channel &ch = channels[(tid / 2) % 1024];
+    bool producer = tid % 2 == 0;
+    if (producer && tid + 1 >= nthreads)
+    { // 落单的线程自己生产自己消费
+        FixedChurn<A>(tid, ops, st, nthreads);
+        return;
+    }
+
+    if (producer)
+    {
+        for (size_t i = 0; i < ops / Batch; ++i)
+        {
+            vector<void *> batch(Batch);
+            for (size_t j = 0; j < Batch; ++j)
+            {
+                Timed(st, [&]() { batch[j] = A::Alloc(Size); });
+                *(char *)batch[j] = 1;
+            }
+
+            std::unique_lock<std::mutex> lock(ch._mtx);
+            ch._cv.wait(lock, [&]() { return ch._queue.size() < 16; });
+            ch._queue.push_back(std::move(batch));
+            ch._cv.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(ch._mtx);
+        ch._done = true;
+        ch._cv.notify_all();
+    }
+    else
+    {
+        while (true)
+        {
+            vector<void *> batch;
+            {
+                std::unique_lock<std::mutex> lock(ch._mtx);
+                ch._cv.wait(lock, [&]() { return !ch._queue.empty() || ch._done; });
+                if (ch._queue.empty())
+                    break;
+                batch = std::move(ch._queue.front());
+                ch._queue.pop_front();
+                ch._cv.notify_all();
+            }
+            for (void *obj : batch)
+                Timed(st, [&]() { A::Free(obj, Size); });
+        }
+    }
+}
+
+/// @brief 长期碎片化：保留大量长寿命块，短寿命块在其间不断替换
+template <class A>
+void Fragmentation(size_t tid, size_t ops, ThreadStat &st, size_t)
+{
+    static const vector<size_t> sizes = ClassSizes();
+    const size_t Live = 8192;
+    vector<void *> objs(Live, nullptr);
+    vector<size_t> objSizes(Live, 0);
+    Rand rnd(tid + 7);
+
+    for (size_t i = 0; i < ops / 2; ++i)
+    {
+        // 前1/8的槽位是长寿命块，只在第一次填充，之后一直持有
+        size_t slot = rnd.Next() % Live;
+        if (objs[slot] && slot < Live / 8)
+            continue;
+        if (objs[slot])
+            Timed(st, [&]() { A::Free(objs[slot], objSizes[slot]); });
+        objSizes[slot] = sizes[rnd.Next() % (sizes.size() / 2)]; // 偏向中小块
+        Timed(st, [&]() { objs[slot] = A::Alloc(objSizes[slot]); });
+        memset(objs[slot], 0, std::min<size_t>(objSizes[slot], 256));
+    }
+    for (size_t i = 0; i < Live; ++i)
+    {
+        if (objs[i])
+            A::Free(objs[i], objSizes[i]);
+    }
+}
+
+/// @brief 寿命与申请时间相关：每轮申请一代块，16轮后整代释放，其中约1%的块活得很久
+/// @details 长寿命块每16轮释放一半，剩下的在负载结束时仍然持有（进程退出前不释放），
+///          结果中的endRSS(KB)即它们散落在各Span中时释放空闲内存后的占用
+template <class A>
+void LifetimeChurn(size_t tid, size_t ops, ThreadStat &st, size_t)
+{
+    static const size_t Sizes[] = {32, 64, 128, 256, 512};
+    const size_t Gens = 16;
+    static std::mutex keptMtx;
+    static vector<void *> kept; // 各线程结束时留下的长寿命块
+
+    struct Obj
+    {
+        void *_ptr;
+        size_t _size;
+    };
+    vector<vector<Obj>> gens(Gens);
+    vector<Obj> live;
+    Rand rnd(tid + 13);
+
+    size_t allocs = 0;
+    for (size_t round = 0; allocs < ops / 2; ++round)
+    {
+        vector<Obj> &gen = gens[round % Gens];
+        for (Obj &o : gen)
+            Timed(st, [&]() { A::Free(o._ptr, o._size); });
+        gen.clear();
+
+        size_t n = 2000 + rnd.Next() % 4 * 1000;
+        for (size_t i = 0; i < n; ++i, ++allocs)
+        {
+            Obj o = {nullptr, Sizes[rnd.Next() % 5]};
+            Timed(st, [&]() { o._ptr = A::Alloc(o._size); });
+            memset(o._ptr, 1, o._size);
+            if (rnd.Next() % 100 == 0)
+                live.push_back(o);
+            else
+                gen.push_back(o);
+        }
+
+        if (round % Gens == Gens - 1)
+        {
+            size_t k = 0;
+            for (Obj &o : live)
+            {
+                if (rnd.Next() % 2)
+                    Timed(st, [&]() { A::Free(o._ptr, o._size); });
+                else
+                    live[k++] = o;
+            }
+            live.resize(k);
+        }
+    }
+
+    for (vector<Obj> &gen : gens)
+    {
+        for (Obj &o : gen)
+            A::Free(o._ptr, o._size);
+    }
+    std::lock_guard<std::mutex> lock(keptMtx);
+    for (Obj &o : live)
+        kept.push_back(o._ptr);
+}
+
+/// @brief 成批申请、使用后成批释放，Batch为true时走批量接口，否则逐个调用
+template <class A, bool Batch>
+void BatchChurn(size_t, size_t ops, ThreadStat &st, size_t)
+{
+    const size_t Size = 64;
+    const size_t N = 256; // 每批的块数
+    void *objs[N];
+
+    for (size_t i = 0; i < ops / (2 * N); ++i)
+    {
+        if (Batch)
+        {
+            TimedBatch(st, N, [&]() { A::AllocBatch(Size, objs, N); });
+        }
+        else
+        {
+            for (size_t j = 0; j < N; ++j)
+                Timed(st, [&]() { objs[j] = A::Alloc(Size); });
+        }
+
+        for (size_t j = 0; j < N; ++j)
+            *(size_t *)objs[j] = j;
+
+        if (Batch)
+        {
+            TimedBatch(st, N, [&]() { A::FreeBatch(objs, N, Size); });
+        }
+        else
+        {
+            for (size_t j = 0; j < N; ++j)
+                Timed(st, [&]() { A::Free(objs[j], Size); });
+        }
+    }
+}
+
+typedef void (*Workload)(size_t tid, size_t ops, ThreadStat &st, size_t nthreads);
+
+/// @brief 运行一个(负载, 分配器)组合并输出一行结果
+/// @param release 负载结束后释放分配器缓存的空闲内存，之后读取endRSS
+void Run(const char *workload, const char *allocator, Workload fn, void (*release)(), size_t nthreads, size_t ops)
+{
+    vector<ThreadStat> stats(nthreads);
+    for (auto &st : stats)
+        st._lat.reserve(ops / (SAMPLE_MASK + 1) + 16);
+
+    vector<std::thread> threads;
+    auto begin = Clock::now();
+    for (size_t t = 0; t < nthreads; ++t)
+        threads.emplace_back([&, t]() { fn(t, ops, stats[t], nthreads); });
+    for (auto &t : threads)
+        t.join();
+    double sec = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    size_t totalOps = 0;
+    vector<uint32_t> lat;
+    for (auto &st : stats)
+    {
+        totalOps += st._ops;
+        lat.insert(lat.end(), st._lat.begin(), st._lat.end());
+    }
+    auto percentile = [&](double p) -> uint32_t
+    {
+        if (lat.empty())
+            return 0;
+        size_t k = std::min(lat.size() - 1, (size_t)(p * lat.size()));
+        std::nth_element(lat.begin(), lat.begin() + k, lat.end());
+        return lat[k];
+    };
+
+    uint32_t p50 = percentile(0.50), p99 = percentile(0.99), p999 = percentile(0.999);
+    size_t peakRSS = PeakRSS();
+    release();
+    printf("%-18s %-16s %8zu %14.0f %8u %8u %8u %12zu %12zu\n",
+           workload, allocator, nthreads, totalOps / sec, p50, p99, p999, peakRSS, CurrentRSS());
+    fflush(stdout);
+}
+
+struct Case
+{
+    const char *_name;
+    Workload _pool;
+    Workload _system;
+};
+
+int main(int argc, char **argv)
+{
+    size_t nthreads = argc > 1 ? std::stoul(argv[1]) : 4;  // 线程数
+    size_t ops = argc > 2 ? std::stoul(argv[2]) : 1000000; // 每个线程的操作数
+    std::string only = argc > 3 ? argv[3] : "";            // 只运行指定负载
+
+    Case cases[] = {
+        {"fixed-churn", FixedChurn<PoolAllocator>, FixedChurn<SystemAllocator>},
+        {"random-sizes", RandomSizes<PoolAllocator>, RandomSizes<SystemAllocator>},
+        {"producer-consumer", ProducerConsumer<PoolAllocator>, ProducerConsumer<SystemAllocator>},
+        {"fragmentation", Fragmentation<PoolAllocator>, Fragmentation<SystemAllocator>},
+        {"lifetime-churn", LifetimeChurn<PoolAllocator>, LifetimeChurn<SystemAllocator>},
+        {"batch-loop", BatchChurn<PoolAllocator, false>, BatchChurn<SystemAllocator, false>},
+        {"batch-api", BatchChurn<PoolAllocator, true>, BatchChurn<SystemAllocator, true>},
+    };
+
+    printf("%-18s %-16s %8s %14s %8s %8s %8s %12s %12s\n",
+           "workload", "allocator", "threads", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)", "peakRSS(KB)", "endRSS(KB)");
+    fflush(stdout); // 子进程会继承未刷新的缓冲区
+    for (const Case &c : cases)
+    {
+        if (!only.empty() && only != c._name)
+            continue;
+
+        for (int which = 0; which < 2; ++which)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                if (which == 0)
+                    Run(c._name, PoolAllocator::Name(), c._pool, PoolAllocator::Release, nthreads, ops);
+                else
+                    Run(c._name, SystemAllocator::Name(), c._system, SystemAllocator::Release, nthreads, ops);
+                _exit(0);
+            }
+
+            int status = 0;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                printf("%s/%s failed\n", c._name, which == 0 ? PoolAllocator::Name() : SystemAllocator::Name());
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
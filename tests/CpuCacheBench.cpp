@@ -0,0 +1,144 @@
+#include "../include/ConcurrentAlloc.h"
+#include "../include/CpuCache.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// ThreadCache与CpuCache两种前端在不同线程数下的吞吐量和内存占用对比
+// CpuCache分别测rseq路径和加锁路径（子进程中设置CONCURRENT_ALLOC_RSEQ=0后首次使用）
+// 每种配置在单独的子进程中运行，互不影响RSS
+
+/// @brief 读取当前进程的常驻内存（KB）
+size_t CurrentRSS()
+{
+    size_t pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+        return 0;
+    if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * ((1 << PAGE_SHIFT) / 1024);
+}
+
+/// @brief 两种前端的统一入口
+struct ThreadCacheFront
+{
+    static void *Alloc(size_t size)
+    {
+        if (pTLSThreadCache == nullptr)
+            pTLSThreadCache = ThreadCache::Create();
+        return pTLSThreadCache->Allocate(size);
+    }
+    static void Free(void *obj, size_t size)
+    {
+        pTLSThreadCache->Deallocate(obj, size);
+    }
+};
+
+struct CpuCacheFront
+{
+    static void *Alloc(size_t size)
+    {
+        return CpuCache::GetInstance()->Allocate(size);
+    }
+    static void Free(void *obj, size_t size)
+    {
+        CpuCache::GetInstance()->Deallocate(obj, size);
+    }
+};
+
+/// @brief nthreads个线程各自做rounds轮申请释放，全部完成后在线程仍存活时统计RSS
+template <class Front>
+void Run(const char *name, size_t nthreads, size_t rounds)
+{
+    const size_t Live = 64; // 每个线程同时持有的块数
+
+    std::atomic<size_t> done{0};
+    std::atomic<bool> quit{false};
+    vector<std::thread> threads;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < nthreads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            void *objs[Live] = {};
+            size_t sizes[Live] = {};
+            size_t seed = t * 2654435761u + 1;
+            for (size_t r = 0; r < rounds; ++r)
+            {
+                size_t i = r % Live;
+                if (objs[i])
+                    Front::Free(objs[i], sizes[i]);
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                sizes[i] = (seed >> 33) % 1024 + 1;
+                objs[i] = Front::Alloc(sizes[i]);
+                memset(objs[i], 0, sizes[i]);
+            }
+            for (size_t i = 0; i < Live; ++i)
+            {
+                if (objs[i])
+                    Front::Free(objs[i], sizes[i]);
+            }
+
+            // 等所有线程结束后再退出，让缓存保持在线程存活时的状态
+            ++done;
+            while (!quit.load())
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        });
+    }
+
+    while (done.load() < nthreads)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto end = std::chrono::steady_clock::now();
+    size_t rss = CurrentRSS();
+
+    quit = true;
+    for (auto &t : threads)
+        t.join();
+
+    double sec = std::chrono::duration<double>(end - begin).count();
+    double ops = 2.0 * nthreads * rounds / sec;
+    printf("%-14s threads=%-4zu ops/s=%12.0f rss=%zuKB\n", name, nthreads, ops, rss);
+}
+
+int main(int argc, char **argv)
+{
+    size_t totalOps = argc > 1 ? std::stoul(argv[1]) : 4000000; // 每种配置的总申请次数
+
+    size_t threadCounts[] = {8, 64, 512};
+    for (size_t n : threadCounts)
+    {
+        for (int front = 0; front < 3; ++front)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                size_t rounds = totalOps / n;
+                if (front == 0)
+                {
+                    Run<ThreadCacheFront>("ThreadCache", n, rounds);
+                }
+                else if (front == 1)
+                { // 平台或内核不支持时CpuCache自己退回加锁路径，按实际路径命名
+                    Run<CpuCacheFront>(CpuCache::GetInstance()->RseqEnabled() ? "CpuCache-rseq" : "CpuCache-lock", n, rounds);
+                }
+                else
+                {
+                    setenv("CONCURRENT_ALLOC_RSEQ", "0", 1); // CpuCache还没有初始化，这里设置仍然有效
+                    Run<CpuCacheFront>("CpuCache-lock", n, rounds);
+                }
+                fflush(stdout);
+                _exit(0);
+            }
+            waitpid(pid, nullptr, 0);
+        }
+    }
+
+    printf("cpu slots: %zu\n", CpuCache::GetInstance()->SlotNum());
+    return 0;
+}
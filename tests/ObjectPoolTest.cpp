@@ -0,0 +1,72 @@
+#include "../include/ObjectPool.h"
+#include <ctime>
+
+struct TreeNode // 一个树结构的节点，申请空间的时候就用这个树节点来申请
+{
+    int _val;
+    TreeNode *_left;
+    TreeNode *_right;
+
+    TreeNode()
+        : _val(0), _left(nullptr), _right(nullptr)
+    {
+    }
+};
+
+/// @brief new/delete和定长内存池的性能对比
+void TestObjectPool()
+{
+    // 申请释放的轮次
+    const size_t Rounds = 5;
+
+    // 每轮申请释放多少次
+    const size_t N = 100000;
+
+    std::vector<TreeNode *> v1;
+    v1.reserve(N);
+
+    // 测试new/delete的性能
+    size_t begin1 = clock();
+    for (size_t j = 0; j < Rounds; ++j)
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            v1.push_back(new TreeNode);
+        }
+        for (size_t i = 0; i < N; ++i)
+        {
+            delete v1[i];
+        }
+        v1.clear(); // size置零但capacity不变，下一轮可以重新push_back
+    }
+    size_t end1 = clock();
+
+    std::vector<TreeNode *> v2;
+    v2.reserve(N);
+
+    // 定长内存池，其中申请和释放的T类型就是树节点
+    ObjectPool<TreeNode> TNPool;
+    size_t begin2 = clock();
+    for (size_t j = 0; j < Rounds; ++j)
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            v2.push_back(TNPool.New());
+        }
+        for (size_t i = 0; i < N; ++i)
+        {
+            TNPool.Delete(v2[i]);
+        }
+        v2.clear();
+    }
+    size_t end2 = clock();
+
+    cout << "new cost time:" << end1 - begin1 << endl;
+    cout << "object pool cost time:" << end2 - begin2 << endl;
+}
+
+int main()
+{
+    TestObjectPool();
+    return 0;
+}
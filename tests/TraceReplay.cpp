@@ -0,0 +1,319 @@
+#include "../include/ConcurrentAlloc.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <numeric>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// 回放追踪文件，对比ConcurrentAlloc/ConcurrentFree与系统malloc/free
+// 用法：TraceReplay 追踪文件 [采样间隔ms]
+// 追踪文件由开启ALLOC_TRACE的内存池写出，例如LD_PRELOAD=libConcurrentMallocTrace.so CONCURRENT_ALLOC_TRACE=app.trace ./app
+// 1. 加载：映射文件，按时间排序（同一线程内保持原顺序），把地址换成从0开始的对象编号并记下申请大小，
+//    追踪开始前申请的块的释放、申请事件被丢弃的块的释放都被跳过
+// 2. 回放：每个追踪线程对应一个回放线程，按原顺序执行；释放其它线程申请的块时先等到该申请完成，保持线程间的先后关系
+//    申请到的块每页写一个字节，和真实程序一样占用物理页
+// 3. 报告：吞吐量、单次调用延迟的直方图，以及按时间采样的存活字节数、RSS增量和两者之比（碎片率）
+// 每个分配器在单独的子进程中回放，RSS互不影响
+
+typedef std::chrono::steady_clock Clock;
+
+static const size_t SAMPLE_MASK = 15; // 每16次调用采样一次延迟，减小计时本身的开销
+static const size_t HIST_NUM = 32;    // 延迟直方图按2的幂分桶
+
+/// @brief 内存池
+struct PoolAllocator
+{
+    static const char *Name() { return "ConcurrentAlloc"; }
+    static void *Alloc(size_t size) { return ConcurrentAlloc(size); }
+    static void Free(void *obj, size_t size) { ConcurrentFree(obj, size); }
+};
+
+/// @brief 系统malloc
+struct SystemAllocator
+{
+    static const char *Name() { return "malloc"; }
+    static void *Alloc(size_t size) { return malloc(size); }
+    static void Free(void *obj, size_t) { free(obj); }
+};
+
+/// @brief 回放时的一次操作
+struct ReplayOp
+{
+    uint32_t _obj; // 对象编号
+    uint8_t _op;   // TraceOp
+};
+
+/// @brief 加载后的追踪
+struct Trace
+{
+    vector<vector<ReplayOp>> _threads; // 每个追踪线程的操作序列
+    vector<uint32_t> _sizes;           // 每个对象的申请大小
+    size_t _events = 0;                // 文件中的事件数
+    size_t _skipped = 0;               // 找不到对应申请而跳过的释放
+};
+
+/// @brief 读取当前进程的常驻内存（KB）
+size_t RSS()
+{
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+        return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return (size_t)resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/// @brief 映射并转换追踪文件，失败时返回false
+bool LoadTrace(const char *path, Trace &trace)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if ((size_t)st.st_size < sizeof(TraceFileHeader))
+    {
+        fprintf(stderr, "%s: too short\n", path);
+        close(fd);
+        return false;
+    }
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    const TraceFileHeader *header = (const TraceFileHeader *)base;
+    if (memcmp(header->_magic, "CMPTRACE", 8) != 0 || header->_version != AllocTrace::VERSION ||
+        header->_eventSize != sizeof(TraceEvent))
+    {
+        fprintf(stderr, "%s: not a version %u trace\n", path, AllocTrace::VERSION);
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    // 进程没有正常退出时文件头中没有事件数，按文件大小计算，末尾未写到的位置地址为0
+    const TraceEvent *events = (const TraceEvent *)base + 1;
+    size_t count = header->_count ? header->_count : st.st_size / sizeof(TraceEvent) - 1;
+    trace._events = count;
+
+    vector<uint32_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+                     { return events[a]._time < events[b]._time; });
+
+    std::unordered_map<uint64_t, uint32_t> live; // 地址 -> 对象编号
+    for (uint32_t i : order)
+    {
+        const TraceEvent &e = events[i];
+        if (e._ptr == 0)
+            continue;
+        if (e._thread >= trace._threads.size())
+            trace._threads.resize(e._thread + 1);
+
+        if (e._op == TRACE_ALLOC)
+        {
+            uint32_t obj = (uint32_t)trace._sizes.size();
+            trace._sizes.push_back(e._size ? e._size : 1);
+            live[e._ptr] = obj; // 释放事件被丢弃时旧对象一直存活
+            trace._threads[e._thread].push_back({obj, TRACE_ALLOC});
+        }
+        else
+        {
+            auto it = live.find(e._ptr);
+            if (it == live.end())
+            {
+                ++trace._skipped;
+                continue;
+            }
+            trace._threads[e._thread].push_back({it->second, TRACE_FREE});
+            live.erase(it);
+        }
+    }
+
+    munmap(base, st.st_size);
+    return true;
+}
+
+/// @brief 每个回放线程的统计结果
+struct ThreadStat
+{
+    size_t _ops = 0;
+    vector<uint32_t> _lat;
+};
+
+/// @brief 回放一遍并输出报告
+template <class A>
+void Replay(const Trace &trace, size_t intervalMs)
+{
+    size_t objNum = trace._sizes.size();
+    std::unique_ptr<std::atomic<void *>[]> objs(new std::atomic<void *>[objNum]());
+    std::atomic<size_t> liveBytes{0};
+    std::atomic<bool> done{false};
+    size_t baseRSS = RSS();
+
+    // 按时间采样存活字节数和RSS，RSS扣除回放前（主要是加载的追踪）的部分
+    struct Point
+    {
+        size_t _ms, _live, _rss;
+    };
+    vector<Point> points;
+    points.reserve(4096);
+    auto begin = Clock::now();
+    std::thread sampler([&]()
+    {
+        while (!done.load(std::memory_order_acquire))
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+            size_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - begin).count();
+            size_t rss = RSS();
+            points.push_back({ms, liveBytes.load(std::memory_order_relaxed) / 1024, rss > baseRSS ? rss - baseRSS : 0});
+        }
+    });
+
+    vector<ThreadStat> stats(trace._threads.size());
+    vector<std::thread> threads;
+    for (size_t t = 0; t < trace._threads.size(); ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            ThreadStat &st = stats[t];
+            st._lat.reserve(trace._threads[t].size() / (SAMPLE_MASK + 1) + 16);
+            for (const ReplayOp &op : trace._threads[t])
+            {
+                size_t size = trace._sizes[op._obj];
+                void *obj = nullptr;
+                if (op._op == TRACE_FREE)
+                { // 等待其它线程完成这个对象的申请
+                    while ((obj = objs[op._obj].load(std::memory_order_acquire)) == nullptr)
+                        sched_yield();
+                }
+
+                bool timed = (st._ops++ & SAMPLE_MASK) == 0;
+                auto t0 = timed ? Clock::now() : Clock::time_point();
+                if (op._op == TRACE_ALLOC)
+                    obj = A::Alloc(size);
+                else
+                    A::Free(obj, size);
+                if (timed)
+                    st._lat.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count());
+
+                if (op._op == TRACE_ALLOC)
+                {
+                    for (size_t off = 0; off < size; off += 4096)
+                        ((volatile char *)obj)[off] = 1;
+                    objs[op._obj].store(obj, std::memory_order_release);
+                    liveBytes.fetch_add(size, std::memory_order_relaxed);
+                }
+                else
+                {
+                    liveBytes.fetch_sub(size, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    double sec = std::chrono::duration<double>(Clock::now() - begin).count();
+    done.store(true, std::memory_order_release);
+    sampler.join();
+
+    size_t totalOps = 0;
+    vector<uint32_t> lat;
+    for (auto &st : stats)
+    {
+        totalOps += st._ops;
+        lat.insert(lat.end(), st._lat.begin(), st._lat.end());
+    }
+    std::sort(lat.begin(), lat.end());
+    auto percentile = [&](double p) -> uint32_t
+    {
+        return lat.empty() ? 0 : lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))];
+    };
+
+    printf("== %s: %zu threads, %zu ops in %.3fs, %.0f ops/s, p50 %uns, p99 %uns, p999 %uns\n",
+           A::Name(), trace._threads.size(), totalOps, sec, totalOps / sec,
+           percentile(0.50), percentile(0.99), percentile(0.999));
+
+    size_t hist[HIST_NUM] = {};
+    for (uint32_t ns : lat)
+    {
+        size_t b = 0;
+        while (b + 1 < HIST_NUM && ((uint32_t)2 << b) <= ns)
+            ++b;
+        ++hist[b];
+    }
+    printf("latency histogram (sampled 1/%zu):\n", SAMPLE_MASK + 1);
+    for (size_t b = 0; b < HIST_NUM; ++b)
+    {
+        if (hist[b] == 0)
+            continue;
+        double pct = 100.0 * hist[b] / lat.size();
+        printf("  [%10u, %10u) ns %10zu %6.2f%% %.*s\n", b ? 1u << b : 0u, 2u << b, hist[b], pct,
+               (int)(pct / 2), "##################################################");
+    }
+
+    printf("fragmentation over time:\n  %8s %12s %12s %8s\n", "ms", "live(KB)", "rss(KB)", "rss/live");
+    for (const Point &p : points)
+        printf("  %8zu %12zu %12zu %8.2f\n", p._ms, p._live, p._rss, p._live ? (double)p._rss / p._live : 0.0);
+    size_t rss = RSS();
+    size_t live = liveBytes.load() / 1024;
+    printf("  %8s %12zu %12zu %8.2f\n\n", "end", live, rss > baseRSS ? rss - baseRSS : 0,
+           live ? (double)(rss > baseRSS ? rss - baseRSS : 0) / live : 0.0);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace-file [interval-ms]\n", argv[0]);
+        return 2;
+    }
+    size_t intervalMs = argc > 2 ? std::stoul(argv[2]) : 50;
+
+    Trace trace;
+    if (!LoadTrace(argv[1], trace))
+        return 1;
+
+    size_t ops = 0;
+    for (auto &v : trace._threads)
+        ops += v.size();
+    printf("%s: %zu events, %zu threads, %zu objects, %zu ops, %zu frees without a matching allocation skipped\n\n",
+           argv[1], trace._events, trace._threads.size(), trace._sizes.size(), ops, trace._skipped);
+    fflush(stdout); // 子进程会继承未刷新的缓冲区
+
+    for (int which = 0; which < 2; ++which)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            if (which == 0)
+                Replay<PoolAllocator>(trace, intervalMs);
+            else
+                Replay<SystemAllocator>(trace, intervalMs);
+            _exit(0);
+        }
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("replay with %s failed\n", which == 0 ? PoolAllocator::Name() : SystemAllocator::Name());
+            return 1;
+        }
+    }
+    return 0;
+}
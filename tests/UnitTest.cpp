@@ -1,4 +1,13 @@
 #include "../include/ConcurrentAlloc.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 void Alloc1()
 {
@@ -24,8 +33,1039 @@ void AllocTest()
     t2.join();
 }
 
+/// @brief 读取当前进程的常驻内存（KB）
+size_t CurrentRSS()
+{
+    size_t pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr)
+        return 0;
+    if (fscanf(fp, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * ((1 << PAGE_SHIFT) / 1024);
+}
+
+/// @brief 一个线程只申请、另一个线程只释放，稳定后内存占用不能持续增长
+void ProducerConsumerTest()
+{
+    const size_t Rounds = 200;     // 生产的批次
+    const size_t BatchNum = 10000; // 每批块数
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<vector<void *>> queue;
+    size_t warmRSS = 0;
+
+    std::thread producer([&]()
+    {
+        for (size_t r = 0; r < Rounds; ++r)
+        {
+            vector<void *> batch(BatchNum);
+            for (size_t i = 0; i < BatchNum; ++i)
+                batch[i] = ConcurrentAlloc((i % 64 + 1) * 16);
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&]() { return queue.size() < 4; }); // 控制在途批次，工作集固定
+            queue.push_back(std::move(batch));
+            cv.notify_all();
+        }
+    });
+
+    std::thread consumer([&]()
+    {
+        for (size_t r = 0; r < Rounds; ++r)
+        {
+            vector<void *> batch;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&]() { return !queue.empty(); });
+                batch = std::move(queue.front());
+                queue.pop_front();
+                cv.notify_all();
+            }
+            for (void *obj : batch)
+                ConcurrentFree(obj);
+
+            if (r == Rounds / 10)
+                warmRSS = CurrentRSS();
+        }
+    });
+
+    producer.join();
+    consumer.join();
+
+    size_t finalRSS = CurrentRSS();
+    cout << "producer/consumer RSS: warm " << warmRSS << "KB, final " << finalRSS << "KB" << endl;
+
+    // 释放的块能回到cc被生产者复用，稳定后占用不随轮次增长
+    assert(finalRSS < warmRSS * 2);
+}
+
+/// @brief 大量短命线程各自申请后释放，块会留在tc中，线程退出时必须还回去
+void ThreadExitTest()
+{
+    const size_t Rounds = 50; // 线程批次
+    const size_t Threads = 8; // 每批线程数
+    const size_t N = 64;      // 每个线程申请的块数
+    size_t warmRSS = 0;
+
+    for (size_t r = 0; r < Rounds; ++r)
+    {
+        vector<std::thread> threads;
+        for (size_t t = 0; t < Threads; ++t)
+        {
+            threads.emplace_back([&]()
+            {
+                vector<void *> objs(N);
+                for (size_t i = 0; i < N; ++i)
+                {
+                    objs[i] = ConcurrentAlloc(32 * 1024); // 大块的tc缓存上限更能体现泄漏
+                    memset(objs[i], 0, 32 * 1024);
+                }
+                for (void *obj : objs)
+                    ConcurrentFree(obj);
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+
+        if (r == Rounds / 10)
+            warmRSS = CurrentRSS();
+    }
+
+    size_t finalRSS = CurrentRSS();
+    cout << "thread exit RSS: warm " << warmRSS << "KB, final " << finalRSS << "KB" << endl;
+
+    // 退出线程的tc被清空并复用，占用不随线程数累积
+    assert(finalRSS < warmRSS * 2);
+}
+
+/// @brief 基数树：首、末和高位页号的读写，中间节点按需创建，未映射的页号返回nullptr
+/// @details MallocShim据此判断一个指针是否由内存池分配
+void PageMapTest()
+{
+    const int Bits = 48 - PAGE_SHIFT;
+    static PageMap<Bits> map; // 根节点有几十KB，不放在栈上
+    const PageID last = ((PageID)1 << Bits) - 1;
+    const PageID high = ((PageID)1 << (Bits - 1)) | 12345;
+    Span a, b, c;
+
+    assert(map.get(0) == nullptr && map.get(last) == nullptr && map.get(high) == nullptr);
+    assert(map.get(last + 1) == nullptr); // 超出地址空间
+    assert(map.NodeCount() == 0);         // 读不创建节点
+
+    map.set(0, &a);
+    assert(map.NodeCount() == 2); // 一个第二层节点和一个叶子
+    map.set(1, &a);
+    assert(map.NodeCount() == 2); // 同一叶子
+    map.set(last, &b);
+    assert(map.NodeCount() == 4);
+    map.set(high, &c);
+    assert(map.NodeCount() == 6);
+
+    assert(map.get(0) == &a && map.get(1) == &a);
+    assert(map.get(last) == &b && map.get(high) == &c);
+    assert(map.get(2) == nullptr && map.get(last - 1) == nullptr && map.get(high + 1) == nullptr);
+
+    // 取消映射后返回nullptr，节点保留，并发的读者拿到的指针仍然有效
+    map.set(high, nullptr);
+    assert(map.get(high) == nullptr && map.NodeCount() == 6);
+
+    // 内存池自己的映射：未分配的地址查不到Span
+    static char local;
+    assert(PageCache::_idSpanMap.get((PageID)&local >> PAGE_SHIFT) == nullptr);
+}
+
+/// @brief 超过128页的申请直接向系统映射，不带大小的释放靠首页映射到的_isLarge Span还给系统
+void LargeAllocTest()
+{
+    const size_t Size = (2 << 20) + 100; // 约2MB，不是页的整数倍
+    size_t unmapped = GetAllocatorStats()._unmappedBytes;
+
+    char *p = (char *)ConcurrentAlloc(Size);
+    assert((uintptr_t)p % (1 << PAGE_SHIFT) == 0);
+    memset(p, 0x5a, Size);
+
+    Span *span = PageCache::MapObjectToSpan(p);
+    assert(span->_isLarge && span->_n > PAGE_NUM);
+    assert((span->_n << PAGE_SHIFT) >= Size);
+    size_t bytes = span->_n << PAGE_SHIFT;
+    PageID id = span->_pageID;
+
+    ConcurrentFree(p);
+    assert(PageCache::_idSpanMap.get(id) == nullptr); // 映射随空间一起撤销
+    assert(GetAllocatorStats()._unmappedBytes - unmapped >= bytes);
+}
+
+/// @brief 标准分配接口的基本语义，LD_PRELOAD加载libConcurrentMalloc.so后运行时检验的是替换后的实现
+void MallocTest()
+{
+    vector<char *> ptrs;
+    for (size_t size = 0; size <= 300 * 1024; size = size * 2 + 1)
+    {
+        char *p = (char *)malloc(size);
+        assert(p && (uintptr_t)p % 16 == 0);
+        memset(p, (int)size, size);
+        ptrs.push_back(p);
+    }
+    for (char *p : ptrs)
+        free(p);
+
+    char *z = (char *)calloc(1000, 3);
+    for (size_t i = 0; i < 3000; ++i)
+        assert(z[i] == 0);
+    memset(z, 7, 3000);
+    z = (char *)realloc(z, 100000); // 扩大后原内容保留
+    for (size_t i = 0; i < 3000; ++i)
+        assert(z[i] == 7);
+    z = (char *)realloc(z, 10); // 缩小
+    assert(z[9] == 7);
+    free(z);
+
+    for (size_t align = 8; align <= 4096; align <<= 1)
+    {
+        void *p = nullptr;
+        assert(posix_memalign(&p, align, 100) == 0);
+        assert((uintptr_t)p % align == 0);
+        free(p);
+    }
+
+    free(nullptr);
+
+    // 替换库遇到不属于内存池的指针：realloc按失败处理，原块保持不变
+    const char *preload = getenv("LD_PRELOAD");
+    if (preload && strstr(preload, "ConcurrentMalloc"))
+    {
+        char *foreign = (char *)mmap(nullptr, 1 << PAGE_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(foreign != MAP_FAILED);
+        foreign[0] = 42;
+        errno = 0;
+        assert(realloc(foreign, 100) == nullptr && errno == ENOMEM);
+        assert(foreign[0] == 42);
+        munmap(foreign, 1 << PAGE_SHIFT);
+    }
+}
+
+/// @brief 尺寸类表：覆盖所有大小、浪费不超过1/SIZE_CLASS_STEPS、对齐申请依赖的整除关系成立
+void SizeClassTest()
+{
+    size_t lastIndex = 0;
+    for (size_t size = 1; size <= MAX_BYTES; ++size)
+    {
+        size_t index = SizeClass::Index(size);
+        size_t alignSize = SizeClass::RoundUp(size);
+        assert(index < FREE_LIST_NUM && index >= lastIndex);
+        assert(alignSize == SizeClass::ClassSize(index) && alignSize >= size);
+        assert(size <= 128 || (alignSize - size) * SIZE_CLASS_STEPS <= alignSize); // 更小的申请受16字节对齐限制
+        lastIndex = index;
+    }
+    assert(SizeClass::ClassSize(FREE_LIST_NUM - 1) == MAX_BYTES);
+
+    // 大小是align的整数倍时，所在尺寸类也是align的整数倍
+    for (size_t align = 8; align <= (1 << PAGE_SHIFT); align <<= 1)
+    {
+        for (size_t size = align; size <= MAX_BYTES; size += align)
+            assert(SizeClass::RoundUp(size) % align == 0);
+    }
+
+    // Span尾部切不出整块的浪费同样有上界
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+    {
+        size_t size = SizeClass::ClassSize(i);
+        size_t bytes = SizeClass::NumMovePage(size) << PAGE_SHIFT;
+        assert(bytes >= size);
+        assert((bytes % size) * SIZE_CLASS_STEPS <= bytes || bytes == (PAGE_NUM << PAGE_SHIFT));
+    }
+}
+
+/// @brief 对齐申请：从缓存行到超过128页的对齐，写满后通过ConcurrentFree(obj)释放
+void AlignedAllocTest()
+{
+    vector<void *> ptrs;
+    for (size_t align = 8; align <= (size_t)4 << 20; align <<= 1)
+    {
+        for (size_t size : {1, 24, 100, 4096, 70000, 300000})
+        {
+            void *p = ConcurrentAllocAligned(size, align);
+            assert((uintptr_t)p % align == 0);
+            memset(p, 0xab, size);
+            ptrs.push_back(p);
+        }
+    }
+    for (void *p : ptrs)
+        ConcurrentFree(p);
+
+    // 同一尺寸类中连续申请的块都要对齐且互不重叠
+    vector<char *> lines;
+    for (int i = 0; i < 10000; ++i)
+    {
+        char *p = (char *)ConcurrentAllocAligned(40, 64);
+        assert((uintptr_t)p % 64 == 0);
+        memset(p, i & 0xff, 40);
+        lines.push_back(p);
+    }
+    for (int i = 0; i < 10000; ++i)
+    {
+        assert((unsigned char)lines[i][39] == (i & 0xff));
+        ConcurrentFree(lines[i]);
+    }
+
+    // 带大小释放时传取整到align倍数后的大小：不超过一页的对齐落回对应尺寸类，
+    // 更大的对齐是不超过MAX_BYTES的整Span，也要走大块路径
+    for (size_t align : {64, 4096, 16384, 65536})
+    {
+        for (size_t size : {1, 100, 5000, 40000})
+        {
+            size_t alignSize = (size + align - 1) & ~(align - 1);
+            vector<void *> objs;
+            for (int i = 0; i < 64; ++i)
+            {
+                void *p = ConcurrentAllocAligned(size, align);
+                assert((uintptr_t)p % align == 0);
+                memset(p, i, size);
+                objs.push_back(p);
+            }
+            for (void *p : objs)
+                ConcurrentFree(p, alignSize);
+        }
+    }
+    ReleaseAllThreadCaches(); // 整Span若被当成小块挂进tc，在这里还给cc时就会出错
+    AllocatorStats stats = GetAllocatorStats();
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+        assert(stats._classes[i]._tcObjects == 0);
+}
+
+/// @brief 批量申请：块互不重叠，可以整批或逐个释放，整批释放后tc不会留下整批的块
+void BatchTest()
+{
+    for (size_t size : {8, 200, 1024, 300000})
+    {
+        for (size_t n : {1, 100, 5000})
+        {
+            vector<void *> objs(n);
+            ConcurrentAllocBatch(size, objs.data(), n);
+            for (size_t i = 0; i < n; ++i)
+                memset(objs[i], (int)i, std::min<size_t>(size, 64));
+
+            vector<void *> sorted(objs);
+            std::sort(sorted.begin(), sorted.end());
+            for (size_t i = 1; i < n; ++i)
+                assert((char *)sorted[i] - (char *)sorted[i - 1] >= (ptrdiff_t)size);
+            for (size_t i = 0; i < n; ++i)
+                assert(*(unsigned char *)objs[i] == (unsigned char)i);
+
+            // 前一半整批释放，后一半逐个释放
+            ConcurrentFreeBatch(objs.data(), n / 2, size);
+            for (size_t i = n / 2; i < n; ++i)
+                ConcurrentFree(objs[i], size);
+        }
+    }
+
+    size_t index = SizeClass::Index(200);
+    assert(GetAllocatorStats()._classes[index]._tcObjects < 5000);
+}
+
+/// @brief 统计快照与实际申请的块数、锁的使用情况一致
+void StatsTest()
+{
+    const size_t N = 5000;
+    vector<void *> objs;
+    for (size_t i = 0; i < N; ++i)
+        objs.push_back(ConcurrentAlloc(200));
+
+    size_t index = SizeClass::Index(200);
+    AllocatorStats stats = GetAllocatorStats();
+    const SizeClassStats &cs = stats._classes[index];
+    assert(cs._size == SizeClass::RoundUp(200));
+    assert(cs._spans > 0 && cs._inUseObjects >= N);
+    assert(cs._lock._acquires > 0);
+    assert(stats._threadCaches >= 1);
+    assert(stats._mappedBytes > stats._unmappedBytes);
+
+    for (void *obj : objs)
+        ConcurrentFree(obj);
+    stats = GetAllocatorStats();
+    assert(stats._classes[index]._tcObjects > 0); // 刚释放的块留在本线程的tc中
+
+    // 调用线程的tc（每CPU缓存模式下是所有槽）立即清空
+    ReleaseAllThreadCaches();
+    assert(GetAllocatorStats()._classes[index]._tcObjects == 0);
+
+    char buf[64];
+    size_t need = FormatAllocatorStats(stats, buf, sizeof(buf), true);
+    assert(need >= sizeof(buf) && buf[0] == '{' && strlen(buf) == sizeof(buf) - 1);
+    vector<char> full(need + 1);
+    assert(FormatAllocatorStats(stats, full.data(), full.size(), true) == need);
+    assert(full[need - 2] == '}');
+}
+
+/// @brief 读出堆采样的头部：存活块数、存活字节、累计块数、累计字节
+void ReadHeapProfile(size_t counts[4])
+{
+    int fd = memfd_create("heap", 0);
+    assert(fd >= 0);
+    DumpHeapProfile(fd);
+    char head[256] = {};
+    assert(pread(fd, head, sizeof(head) - 1, 0) > 0);
+    close(fd);
+
+    size_t rate = 0;
+    int n = sscanf(head, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                   &counts[0], &counts[1], &counts[2], &counts[3], &rate);
+    assert(n == 5 && rate == HeapProfiler::SampleRate());
+}
+
+/// @brief 堆采样：存活量随释放减少，累计量只增不减，采样块可以按大小释放
+void HeapProfileTest()
+{
+    SetHeapProfileSampleRate(4096);
+
+    const size_t N = 20000;
+    vector<void *> objs;
+    for (size_t i = 0; i < N; ++i)
+    {
+        void *obj = ConcurrentAlloc(100);
+        memset(obj, 1, 100);
+        if (i % 2)
+            ConcurrentFree(obj, 100);
+        else
+            objs.push_back(obj);
+    }
+
+    size_t counts[4];
+    ReadHeapProfile(counts);
+    assert(counts[0] > 0 && counts[1] == counts[0] * 100);
+    assert(counts[2] > counts[0] && counts[3] > counts[1]);
+
+    for (void *obj : objs)
+        ConcurrentFree(obj, 100);
+    size_t after[4];
+    ReadHeapProfile(after);
+    assert(after[0] == 0 && after[1] == 0);
+    assert(after[2] == counts[2] && after[3] == counts[3]);
+
+    SetHeapProfileSampleRate(0);
+}
+
+/// @brief 占用率分组：总是取最满的有空闲块的Span，满Span不会被取到，组变空后掩码位随之清除
+void SpanBinsTest()
+{
+    static_assert(OCCUPANCY_BINS == 8, "下面的分组按8组计算");
+    const size_t Capacity = 80; // 每组10块
+    Span a, b, c, d;
+    for (Span *span : {&a, &b, &c, &d})
+        span->_capacity = Capacity;
+
+    SpanBins bins;
+    assert(bins.Pick() == nullptr);
+
+    a._use_count = 5;
+    bins.Insert(&a);
+    assert(a._bin == 0 && bins.Pick() == &a);
+    c._use_count = Capacity; // 没有空闲块
+    bins.Insert(&c);
+    assert(c._bin == SpanBins::FULL && bins.Pick() == &a);
+    b._use_count = 45;
+    bins.Insert(&b);
+    assert(b._bin == 4 && bins.Pick() == &b);
+    d._use_count = 15;
+    bins.Insert(&d);
+    assert(d._bin == 1 && bins.Pick() == &b);
+
+    // 组内变化不移动，跨组后移到新组
+    b._use_count = 49;
+    bins.Update(&b);
+    assert(b._bin == 4 && bins.Pick() == &b);
+    b._use_count = 75;
+    bins.Update(&b);
+    assert(b._bin == 7 && bins.Pick() == &b);
+    a._use_count = 72;
+    bins.Update(&a);
+    assert(a._bin == 7 && bins.Pick() == &a); // 最近进入该组的在头部
+
+    // 第7组的两个Span都满了：组变空后掩码位必须清除，否则取不到第1组的d
+    a._use_count = Capacity;
+    bins.Update(&a);
+    b._use_count = Capacity;
+    bins.Update(&b);
+    assert(a._bin == SpanBins::FULL && b._bin == SpanBins::FULL);
+    assert(bins.Pick() == &d);
+
+    // 满Span有块还回来后重新可取
+    c._use_count = 30;
+    bins.Update(&c);
+    assert(c._bin == 3 && bins.Pick() == &c);
+
+    size_t count = 0;
+    bins.ForEach([&](Span *) { ++count; });
+    assert(count == 4);
+
+    bins.Erase(&c);
+    assert(bins.Pick() == &d);
+    bins.Erase(&d);
+    assert(bins.Pick() == nullptr); // 只剩满Span
+    bins.Erase(&a);
+    bins.Erase(&b);
+    count = 0;
+    bins.ForEach([&](Span *) { ++count; });
+    assert(count == 0);
+}
+
+/// @brief 按需切分：先取Span中还回来的块，不够再从切分指针往后切，末尾的零头不分出；全部还回后Span交还pc
+void CarveTest()
+{
+    ReleaseAllThreadCaches();
+    ConcurrentReleaseFreeMemory();
+
+    // 选一个Span大小不是块大小整数倍、至少能切5块、并且当前cc中没有Span的尺寸类，下面拿到的一定是新Span
+    AllocatorStats stats = GetAllocatorStats();
+    size_t size = 0, capacity = 0;
+    for (size_t i = FREE_LIST_NUM; i-- > 0;)
+    {
+        size_t s = SizeClass::ClassSize(i);
+        size_t bytes = SizeClass::NumMovePage(s) << PAGE_SHIFT;
+        if (bytes % s != 0 && bytes / s >= 5 && stats._classes[i]._spans == 0)
+        {
+            size = s;
+            capacity = bytes / s;
+            break;
+        }
+    }
+    assert(size > 0);
+
+    CentralCache *cc = CentralCache::GetInstance();
+    void *start = nullptr, *end = nullptr;
+    assert(cc->FetchRangeObj(start, end, 2, size) == 2);
+    Span *span = PageCache::MapObjectToSpan(start);
+    char *base = (char *)(span->_pageID << PAGE_SHIFT);
+    char *spanEnd = base + (span->_n << PAGE_SHIFT);
+    assert(start == base && end == base + size && LoadNext(start) == end);
+    assert(span->_use_count == 2 && span->_carve == base + 2 * size && span->_freeList == nullptr);
+
+    // 还回第一块，Span的自由链表中只有它
+    void *second = end;
+    StoreNext(start, nullptr);
+    cc->ReleaseListToSpans(start, size);
+    assert(span->_use_count == 1 && span->_freeList == base);
+
+    // 一次取3块：1块来自自由链表，2块从切分指针切出
+    void *start2 = nullptr, *end2 = nullptr;
+    assert(cc->FetchRangeObj(start2, end2, 3, size) == 3);
+    assert(start2 == base && LoadNext(start2) == base + 2 * size && end2 == base + 3 * size);
+    assert(span->_use_count == 4 && span->_carve == base + 4 * size && span->_freeList == nullptr);
+
+    // 取走剩下的全部，最后一块之后放不下一整块的零头不会分出
+    void *start3 = nullptr, *end3 = nullptr;
+    assert(cc->FetchRangeObj(start3, end3, capacity, size) == capacity - 4);
+    assert(start3 == base + 4 * size && end3 == base + (capacity - 1) * size);
+    assert(span->_carve == span->_carveEnd && span->_carveEnd == base + capacity * size);
+    assert(span->_carveEnd < spanEnd && (size_t)(spanEnd - span->_carveEnd) < size);
+    assert(span->_use_count == capacity);
+
+    // 全部还回后_use_count归零，Span还给pc
+    vector<void *> objs = {second};
+    for (void *obj = start2; obj; obj = LoadNext(obj))
+        objs.push_back(obj);
+    for (void *obj = start3; obj; obj = LoadNext(obj))
+        objs.push_back(obj);
+    assert(objs.size() == capacity);
+    for (size_t i = 0; i + 1 < objs.size(); ++i)
+        StoreNext(objs[i], objs[i + 1]);
+    StoreNext(objs.back(), nullptr);
+    PageID id = span->_pageID;
+    cc->ReleaseListToSpans(objs[0], size);
+
+    Span *freed = PageCache::_idSpanMap.get(id); // 可能已与相邻的空闲Span合并，或随整个区域解除映射
+    assert(freed == nullptr || !freed->_isUse);
+    assert(GetAllocatorStats()._classes[SizeClass::Index(size)]._spans == 0);
+}
+
+/// @brief 中转缓存：一个线程整批还回的块原样交给另一个线程，不碰Span的桶锁；释放空闲内存时中转缓存被清空
+void TransferCacheTest()
+{
+    const size_t Size = SizeClass::RoundUp(96);
+    const size_t index = SizeClass::Index(Size);
+    const size_t Batch = SizeClass::NumMoveSize(Size);
+
+    ConcurrentReleaseFreeMemory(); // 先清空中转缓存，下面放入的是唯一的一批
+
+    void *start = nullptr, *end = nullptr;
+    size_t n = 0;
+    std::thread([&]()
+    {
+        CentralCache *cc = CentralCache::GetInstance();
+        n = cc->FetchRangeObj(start, end, Batch, Size);
+        cc->ReleaseRangeObj(start, end, n, Size);
+    }).join();
+
+    // 每次收集统计都会给每个节点的桶锁加一次锁
+    AllocatorStats before = GetAllocatorStats();
+    assert(before._classes[index]._transferObjects == n);
+
+    void *start2 = nullptr, *end2 = nullptr;
+    size_t n2 = 0;
+    std::thread([&]()
+    { // 多节点时这批块放在第一块所属节点的中转缓存中
+        CentralCache *cc = CentralCache::GetInstance(PageCache::MapObjectToSpan(start));
+        n2 = cc->FetchRangeObj(start2, end2, 1, Size);
+    }).join();
+
+    AllocatorStats after = GetAllocatorStats();
+    assert(n2 == n && start2 == start && end2 == end); // 整批原样取走，多于请求的1块
+    assert(after._classes[index]._transferObjects == 0);
+    assert(after._classes[index]._lock._acquires - before._classes[index]._lock._acquires == Numa::NodeCount());
+
+    // 还回去后由ConcurrentReleaseFreeMemory拆回Span
+    CentralCache::GetInstance()->ReleaseRangeObj(start2, end2, n2, Size);
+    assert(GetAllocatorStats()._classes[index]._transferObjects == n);
+    ConcurrentReleaseFreeMemory();
+    after = GetAllocatorStats();
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+        assert(after._classes[i]._transferObjects == 0);
+}
+
+/// @brief PageCache分片：各线程的Span来自不同分片，由其它线程释放时还给所属分片而不是释放线程绑定的分片
+void ArenaTest()
+{
+    const size_t Threads = ARENA_NUM;
+    const size_t Size = 300 * 1024; // 超过MAX_BYTES、不超过128页，直接从分片中切出
+    vector<void *> objs(Threads);
+    vector<size_t> arenas(Threads);
+
+    vector<std::thread> threads;
+    for (size_t t = 0; t < Threads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            objs[t] = ConcurrentAlloc(Size);
+            arenas[t] = PageCache::MapObjectToSpan(objs[t])->_arena;
+            assert(PageCache::GetArena(arenas[t]) == PageCache::GetInstance()); // 来自本线程绑定的分片
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    vector<size_t> distinct(arenas);
+    std::sort(distinct.begin(), distinct.end());
+    assert(std::unique(distinct.begin(), distinct.end()) - distinct.begin() > 1);
+
+    // 由本线程释放不属于本线程分片的Span，只有所属分片的锁被使用
+    size_t self = PageCache::GetInstance() - PageCache::GetArena(0);
+    size_t expected[ARENA_NUM] = {};
+    AllocatorStats before = GetAllocatorStats();
+    for (size_t t = 0; t < Threads; ++t)
+    {
+        if (arenas[t] == self)
+            continue;
+        ConcurrentFree(objs[t]);
+        objs[t] = nullptr;
+        ++expected[arenas[t]];
+    }
+    AllocatorStats after = GetAllocatorStats();
+    for (size_t a = 0; a < ARENA_NUM; ++a)
+    { // 收集统计本身也给每个分片加一次锁
+        assert(after._arenas[a]._lock._acquires - before._arenas[a]._lock._acquires == expected[a] + 1);
+    }
+
+    for (void *obj : objs)
+    {
+        if (obj)
+            ConcurrentFree(obj);
+    }
+}
+
+/// @brief NUMA：线程只从本节点的分片取Span，跨节点释放的块回到原节点
+/// @details 单节点机器上通过CONCURRENT_ALLOC_NUMA_NODES模拟多个节点运行
+void NumaTest()
+{
+    const size_t Threads = 4, N = 2000;
+    size_t nodes = Numa::NodeCount();
+    vector<vector<void *>> objs(Threads);
+    vector<size_t> threadNodes(Threads);
+
+    vector<std::thread> threads;
+    for (size_t t = 0; t < Threads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            size_t node = PageCache::GetInstance()->Node();
+            threadNodes[t] = node;
+            assert(CentralCache::GetInstance() == CentralCache::GetNode(node));
+            for (size_t i = 0; i < N; ++i)
+            {
+                size_t size = i % 2 ? 64 : 300 * 1024 / (i % 7 + 1);
+                void *obj = ConcurrentAlloc(size);
+#ifdef PER_CPU_CACHE
+                if (size > MAX_BYTES) // 按CPU缓存时一个槽由多个线程共用，小块可能来自其它线程的节点
+#endif
+                    assert(PageCache::MapObjectToSpan(obj)->_arena % nodes == node);
+                objs[t].push_back(obj);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    if (nodes > 1)
+    { // 模拟时线程轮流分到各节点
+        assert(std::count(threadNodes.begin(), threadNodes.end(), threadNodes[0]) < (long)Threads);
+    }
+
+    // 由另一个线程统一释放，块要回到各自节点的cc
+    for (auto &v : objs)
+    {
+        for (void *obj : v)
+            ConcurrentFree(obj);
+    }
+    ReleaseAllThreadCaches();
+    ConcurrentReleaseFreeMemory();
+}
+
+/// @brief 其它线程不停申请、释放和汇总统计时fork，子进程中申请、释放和清空缓存都不能死锁
+void ForkTest()
+{
+    std::atomic<bool> stop{false};
+    vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            vector<void *> objs;
+            for (size_t i = 0; !stop.load(std::memory_order_relaxed); ++i)
+            {
+                size_t size = (i * 7 + t) % 4 == 0 ? 300 * 1024 : (i % 500 + 1) * 16;
+                objs.push_back(i % 3 ? ConcurrentAlloc(size) : ConcurrentAllocAligned(size, 16384));
+                if (objs.size() > 200)
+                {
+                    for (void *obj : objs)
+                        ConcurrentFree(obj);
+                    objs.clear();
+                }
+            }
+            for (void *obj : objs)
+                ConcurrentFree(obj);
+        });
+    }
+    threads.emplace_back([&]()
+    {
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            ReleaseAllThreadCaches();
+            ConcurrentReleaseFreeMemory();
+            GetAllocatorStats();
+        }
+    });
+
+    for (int r = 0; r < 50; ++r)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            alarm(10); // 死锁时由SIGALRM终止
+            vector<void *> objs;
+            for (size_t i = 0; i < 2000; ++i)
+                objs.push_back(ConcurrentAlloc(i % 10 ? (i % 500 + 1) * 16 : 300 * 1024));
+            for (void *obj : objs)
+                ConcurrentFree(obj);
+            ReleaseAllThreadCaches();
+            ConcurrentReleaseFreeMemory();
+            GetAllocatorStats();
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    stop = true;
+    for (auto &t : threads)
+        t.join();
+}
+
+#ifdef PER_CPU_CACHE
+/// @brief 每CPU缓存：多个线程共用各CPU的槽反复申请释放，另一个线程同时不断清空各槽，一块不能同时交给两个线程
+/// @details 设置CONCURRENT_ALLOC_RSEQ=0时检查的是加锁路径
+void CpuCacheTest()
+{
+    CpuCache *cache = CpuCache::GetInstance();
+    const char *env = getenv("CONCURRENT_ALLOC_RSEQ");
+    if (env && strcmp(env, "0") == 0)
+        assert(!cache->RseqEnabled());
+    cout << "cpu cache: " << (cache->RseqEnabled() ? "rseq" : "locked") << endl;
+
+    const size_t Threads = 8;
+    const size_t Rounds = 20000;
+    const size_t Live = 64;
+    const size_t Sizes[] = {16, 48, 200, 1000, 5000, 40000}; // 最后一种每个槽只缓存一块
+
+    std::atomic<bool> stop{false};
+    std::thread drainer([&]()
+    {
+        while (!stop.load())
+        {
+            ReleaseAllThreadCaches();
+            std::this_thread::yield();
+        }
+    });
+
+    vector<std::thread> threads;
+    for (size_t t = 0; t < Threads; ++t)
+    {
+        threads.emplace_back([t, &Sizes]()
+        {
+            uint64_t *objs[Live] = {};
+            size_t sizes[Live] = {};
+            uint64_t stamps[Live] = {};
+            for (size_t r = 0; r < Rounds; ++r)
+            {
+                size_t i = (r * 7 + t) % Live;
+                if (objs[i])
+                {
+                    assert(objs[i][0] == stamps[i] && objs[i][1] == ~stamps[i]); // 期间没有被交给别的线程
+                    ConcurrentFree(objs[i], sizes[i]);
+                }
+                sizes[i] = Sizes[(r + t) % 6];
+                stamps[i] = (uint64_t)t << 32 | r;
+                objs[i] = (uint64_t *)ConcurrentAlloc(sizes[i]);
+                objs[i][0] = stamps[i];
+                objs[i][1] = ~stamps[i];
+            }
+            for (size_t i = 0; i < Live; ++i)
+            {
+                if (objs[i])
+                {
+                    assert(objs[i][0] == stamps[i] && objs[i][1] == ~stamps[i]);
+                    ConcurrentFree(objs[i], sizes[i]);
+                }
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    stop = true;
+    drainer.join();
+
+    ReleaseAllThreadCaches();
+    AllocatorStats stats = GetAllocatorStats();
+    for (size_t i = 0; i < FREE_LIST_NUM; ++i)
+        assert(stats._classes[i]._tcObjects == 0);
+}
+#endif
+
+#ifdef HUGEPAGE_SPANS
+/// @brief 大页：小Span挤在同一个大页中，大页完全空闲后整个还给系统
+/// @details 需要在其它测试之前运行，此时当前线程绑定的分片还是空的
+void HugePageTest()
+{
+    const size_t K = 8, N = HUGE_PAGE_PAGES / K; // 正好填满一个大页
+    PageCache *pc = PageCache::GetInstance();
+    vector<Span *> spans;
+
+    pc->_pageMtx.lock();
+    for (size_t i = 0; i < N; ++i)
+    {
+        Span *span = pc->NewSpan(K);
+        span->_isUse = true;
+        spans.push_back(span);
+    }
+    pc->_pageMtx.unlock();
+
+    PageID huge = spans[0]->_pageID / HUGE_PAGE_PAGES;
+    for (Span *span : spans)
+        assert(span->_pageID / HUGE_PAGE_PAGES == huge && span->_huge == spans[0]->_huge);
+    assert(spans[0]->_huge->_usedPages == HUGE_PAGE_PAGES);
+
+    size_t unmapped = systemCounters._unmappedBytes.load();
+    pc->_pageMtx.lock();
+    for (Span *span : spans)
+        pc->ReleaseSpanToPageCache(span);
+    pc->ReleaseIdleSpans(true);
+    pc->_pageMtx.unlock();
+
+    assert(systemCounters._unmappedBytes.load() - unmapped == HUGE_PAGE_PAGES << PAGE_SHIFT);
+    assert(PageCache::_idSpanMap.get(huge * HUGE_PAGE_PAGES) == nullptr);
+}
+#endif
+
+#if defined(GUARDED_ALLOC) || defined(HARDENED_FREELIST)
+/// @brief 在子进程中执行f，期望调试模式检查出错误并abort
+template <class F>
+void ExpectAbort(F &&f)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        freopen("/dev/null", "w", stderr);
+        f();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+#endif
+
+#ifdef GUARDED_ALLOC
+/// @brief 调试模式：重复释放、大小不符、内部指针、释放后写都要被发现
+void GuardedAllocTest()
+{
+    ExpectAbort([]()
+    {
+        void *p = ConcurrentAlloc(64);
+        ConcurrentFree(p, 64);
+        ConcurrentFree(p, 64);
+    });
+    ExpectAbort([]()
+    {
+        void *p = ConcurrentAlloc(64);
+        ConcurrentFree(p, 512);
+    });
+    ExpectAbort([]()
+    {
+        char *p = (char *)ConcurrentAlloc(64);
+        ConcurrentFree(p + 16);
+    });
+    ExpectAbort([]()
+    {
+        void *p = ConcurrentAlloc(300 * 1024);
+        ConcurrentFree(p);
+        ConcurrentFree(p);
+    });
+#ifdef GUARDED_ALLOC_POISON
+    ExpectAbort([]()
+    {
+        char *p = (char *)ConcurrentAlloc(64);
+        ConcurrentFree(p, 64);
+        p[32] = 1;                  // 释放后写
+        for (int i = 0; i < 2; ++i) // tc后进先出，下一次申请就会拿到p
+            ConcurrentAlloc(64);
+    });
+#endif
+
+    // 正常的申请释放不受影响
+    vector<void *> objs;
+    for (size_t i = 0; i < 1000; ++i)
+        objs.push_back(ConcurrentAlloc(i % 2000 + 1));
+    for (size_t i = 0; i < objs.size(); ++i)
+        ConcurrentFree(objs[i], i % 2000 + 1);
+}
+#endif
+
+#ifdef HARDENED_FREELIST
+/// @brief 加固自由链表：空闲块中的链接被溢出改写后，下一次弹出时终止进程
+void HardenedFreeListTest()
+{
+    ExpectAbort([]()
+    {
+        void *p = ConcurrentAlloc(64);
+        void *q = ConcurrentAlloc(64);
+        ConcurrentFree(q, 64);
+        ConcurrentFree(p, 64); // p在q之前，p中存放着指向q的链接
+        memset(p, 0x41, sizeof(void *));
+        for (int i = 0; i < 4; ++i) // 这批块可能已经整批还给了cc，再次取回后第二次申请才会用到被改写的链接
+            ConcurrentAlloc(64);
+    });
+}
+#endif
+
+#ifdef ALLOC_TRACE
+/// @brief 追踪：每个线程的申请和释放事件都按顺序写入文件，释放在申请之后
+void AllocTraceTest()
+{
+    const size_t Threads = 4, N = 10000;
+    int fd = memfd_create("trace", 0);
+    assert(fd >= 0);
+    assert(StartAllocTrace(fd));
+    assert(!StartAllocTrace(fd)); // 不能重复开始
+
+    vector<std::thread> threads;
+    for (size_t t = 0; t < Threads; ++t)
+    {
+        threads.emplace_back([t]()
+        {
+            for (size_t i = 0; i < N; ++i)
+            {
+                size_t size = (t + 1) * 8 + i % 3000;
+                void *obj = ConcurrentAlloc(size);
+                if (i % 2)
+                    ConcurrentFree(obj, size);
+                else
+                    ConcurrentFree(obj);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    assert(StopAllocTrace() == 0);
+
+    off_t bytes = lseek(fd, 0, SEEK_END);
+    TraceFileHeader header;
+    assert(pread(fd, &header, sizeof(header), 0) == sizeof(header));
+    assert(memcmp(header._magic, "CMPTRACE", 8) == 0 && header._eventSize == sizeof(TraceEvent));
+    size_t count = header._count;
+    assert(count == Threads * N * 2 && (size_t)bytes == (count + 1) * sizeof(TraceEvent));
+    vector<TraceEvent> events(count);
+    assert(pread(fd, events.data(), count * sizeof(TraceEvent), sizeof(header)) == (ssize_t)(count * sizeof(TraceEvent)));
+    close(fd);
+
+    // 按线程编号分组后，每个线程的事件应该是交替的申请、释放同一个块，时间不减
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b)
+                     { return a._thread < b._thread; });
+    for (size_t i = 0; i < count; i += 2)
+    {
+        const TraceEvent &a = events[i], &f = events[i + 1];
+        assert(a._thread == f._thread);
+        assert(a._op == TRACE_ALLOC && f._op == TRACE_FREE && a._ptr == f._ptr);
+        assert(f._time >= a._time);
+        assert(f._size == a._size || f._size == 0);
+    }
+
+    // 文件不允许缩小时，停止时截不掉多余的窗口，事件数也不会写入，必须报告失败
+    fd = memfd_create("trace", MFD_ALLOW_SEALING);
+    assert(fd >= 0);
+    assert(StartAllocTrace(fd));
+    assert(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0);
+    ConcurrentFree(ConcurrentAlloc(100));
+    assert(StopAllocTrace() == AllocTrace::STOP_FAILED);
+    assert(pread(fd, &header, sizeof(header), 0) == sizeof(header) && header._count == 0);
+    close(fd);
+}
+#endif
+
 int main()
 {
+#ifdef HUGEPAGE_SPANS
+    HugePageTest();
+#endif
+#ifdef GUARDED_ALLOC
+    GuardedAllocTest();
+#endif
+#ifdef HARDENED_FREELIST
+    HardenedFreeListTest();
+#endif
+#ifdef ALLOC_TRACE
+    AllocTraceTest();
+#endif
+    PageMapTest();
+    SizeClassTest();
+    LargeAllocTest();
+    MallocTest();
+    AlignedAllocTest();
+    BatchTest();
+    StatsTest();
+    SpanBinsTest();
+    CarveTest();
+    TransferCacheTest();
+    ArenaTest();
+    NumaTest();
+    ForkTest();
+#ifdef PER_CPU_CACHE
+    CpuCacheTest();
+#endif
+    HeapProfileTest();
     AllocTest();
+    ProducerConsumerTest();
+    ThreadExitTest();
     return 0;
 }
\ No newline at end of file